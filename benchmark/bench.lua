@@ -88,6 +88,8 @@ end
 
 local totalTimes = {
 	simdjson = 0,
+	simdjson_presize = 0,
+	simdjson_dom = 0,
 	cjson = 0,
 	dkjson = 0,
 	rapidjson = 0
@@ -110,6 +112,16 @@ for i,filename in ipairs(jsonchecker) do
 	row["simdjson"] = time
 	totalTimes["simdjson"] = totalTimes["simdjson"] + time
 
+	time = timeIt(function(contents) return simdjson.parse(contents, {presize = true}) end, json_contents)
+	print("simd (presize)", time)
+	row["simdjson_presize"] = time
+	totalTimes["simdjson_presize"] = totalTimes["simdjson_presize"] + time
+
+	time = timeIt(function(contents) return simdjson.parse(contents, {engine = "dom"}) end, json_contents)
+	print("simd (dom)", time)
+	row["simdjson_dom"] = time
+	totalTimes["simdjson_dom"] = totalTimes["simdjson_dom"] + time
+
 	time = timeIt(cjson.decode, json_contents)
 	print("cjson", time)
 	row["cjson"] = time
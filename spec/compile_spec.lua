@@ -58,6 +58,226 @@ describe("Make sure it parses files correctly", function()
     end
 end)
 
+describe("Make sure presized parsing matches the default mode", function()
+    for _, file in ipairs(files) do
+        it("should parse the file: " .. file, function()
+            local fileContents = loadFile("jsonexamples/" .. file)
+            local cjsonDecodedValues = cjson.decode(fileContents)
+            assert.are.same(cjsonDecodedValues, simdjson.parse(fileContents, {presize = true}))
+            assert.are.same(cjsonDecodedValues, simdjson.parseFile("jsonexamples/" .. file, {presize = true}))
+        end)
+    end
+
+    it("should reject unknown or mistyped options", function()
+        assert.has_error(function() simdjson.parse("[]", {presized = true}) end)
+        assert.has_error(function() simdjson.parse("[]", {presize = 1}) end)
+        assert.has_error(function() simdjson.parse("[]", "presize") end)
+    end)
+end)
+
+describe("Make sure the dom engine matches the default engine", function()
+    for _, file in ipairs(files) do
+        it("should parse the file: " .. file, function()
+            local fileContents = loadFile("jsonexamples/" .. file)
+            local cjsonDecodedValues = cjson.decode(fileContents)
+            assert.are.same(cjsonDecodedValues, simdjson.parse(fileContents, {engine = "dom"}))
+            assert.are.same(cjsonDecodedValues, simdjson.parseFile("jsonexamples/" .. file, {engine = "dom"}))
+        end)
+    end
+
+    it("should reject unknown engines", function()
+        assert.has_error(function() simdjson.parse("[]", {engine = "tape"}) end)
+        assert.has_error(function() simdjson.parse("[]", {engine = true}) end)
+    end)
+end)
+
+describe("Make sure projected parsing selects the requested paths", function()
+    local json = [[
+{
+    "user": {"id": 7, "name": "ann", "tags": ["a", "b"]},
+    "items": [{"price": 1.5, "sku": "x"}, {"price": 2, "sku": "y"}, {"sku": "z"}],
+    "a/b": {"~": true},
+    "esc\u0061ped": 1,
+    "count": 3
+}
+]]
+
+    it("should keep only the listed pointers", function()
+        assert.are.same(
+            {user = {id = 7}, items = {{price = 1.5}, {price = 2}}},
+            simdjson.parse(json, {only = {"/user/id", "/items/*/price"}})
+        )
+    end)
+
+    it("should convert selected subtrees in full", function()
+        assert.are.same(
+            {user = {id = 7, name = "ann", tags = {"a", "b"}}, count = 3},
+            simdjson.parse(json, {only = {"/user", "/count", "/missing/path"}})
+        )
+    end)
+
+    it("should handle array indexes, escaped tokens and escaped keys", function()
+        assert.are.same(
+            {items = {[2] = {sku = "y"}}, ["a/b"] = {["~"] = true}, escaped = 1},
+            simdjson.parse(json, {only = {"/items/1/sku", "/a~1b/~0", "/escaped"}})
+        )
+    end)
+
+    it("should merge wildcard and named paths", function()
+        assert.are.same(
+            {user = {id = 7, name = "ann"}},
+            simdjson.parse(json, {only = {"/*/id", "/user/name"}})
+        )
+    end)
+
+    it("should match a full parse for the whole document", function()
+        for _, file in ipairs(files) do
+            local fileContents = loadFile("jsonexamples/" .. file)
+            assert.are.same(simdjson.parse(fileContents), simdjson.parse(fileContents, {only = {""}}))
+        end
+        assert.are.same(
+            simdjson.parseFile("jsonexamples/twitter.json").statuses[3].user,
+            simdjson.parseFile("jsonexamples/twitter.json", {only = {"/statuses/2/user"}}).statuses[3].user
+        )
+    end)
+
+    it("should leave out paths that do not exist", function()
+        assert.are.same({}, simdjson.parse(json, {only = {"/user/missing", "/count/below"}}))
+        assert.is_nil(simdjson.parse("5", {only = {"/a"}}))
+        assert.are.same({1, [3] = 3}, simdjson.parse("[1, 2, 3]", {only = {"/0", "/2"}}))
+    end)
+
+    it("should reject invalid projections", function()
+        assert.has_error(function() simdjson.parse(json, {only = "/user"}) end)
+        assert.has_error(function() simdjson.parse(json, {only = {"user"}}) end)
+        assert.has_error(function() simdjson.parse(json, {only = {"/user/~2"}}) end)
+        assert.has_error(function() simdjson.parse(json, {only = {"/user"}, engine = "dom"}) end)
+    end)
+end)
+
+describe("Make sure repeated object keys are decoded correctly", function()
+    it("should keep escaped and unescaped spellings of a key apart", function()
+        local json = '[{"a\\u0062": 1, "ab": 2}, {"ab": 3, "a\\u0062": 4}, {"a\\"b": 5}]'
+        for _, engine in ipairs({"ondemand", "dom"}) do
+            local decoded = simdjson.parse(json, {engine = engine})
+            assert.are.same({{ab = 2}, {ab = 4}, {['a"b'] = 5}}, decoded)
+        end
+    end)
+
+    it("should handle more distinct keys than the cache holds", function()
+        local fields, expected = {}, {}
+        for i = 1, 1000 do
+            fields[#fields + 1] = string.format('"key%d": %d', i, i)
+            expected["key" .. i] = i
+        end
+        local json = "[{" .. table.concat(fields, ",") .. "},{" .. table.concat(fields, ",") .. "}]"
+        for _, engine in ipairs({"ondemand", "dom"}) do
+            assert.are.same({expected, expected}, simdjson.parse(json, {engine = engine}))
+        end
+    end)
+end)
+
+describe("Make sure deeply nested documents are handled", function()
+    local function nested(depth)
+        return string.rep('[{"a":', depth) .. "1" .. string.rep("}]", depth)
+    end
+
+    it("should parse documents up to the depth limit", function()
+        for _, engine in ipairs({"ondemand", "dom"}) do
+            local value = simdjson.parse(nested(500), {engine = engine})
+            for _ = 1, 500 do
+                value = value[1].a
+            end
+            assert.are.equal(1, value)
+        end
+    end)
+
+    it("should reject documents beyond the depth limit", function()
+        for _, engine in ipairs({"ondemand", "dom"}) do
+            assert.has_error(function() simdjson.parse(nested(600), {engine = engine}) end)
+        end
+        assert.has_error(function() simdjson.open(nested(600)):atPointer("") end)
+    end)
+end)
+
+describe("Make sure large files are read correctly", function()
+    -- Files of at least 1 MB are memory mapped. Sizes that are a multiple of
+    -- the page size need padding pages after the file; others pad within
+    -- their last page.
+    local function writeJson(size)
+        local prefix, suffix = '{"padding": "', '", "last": [1, 2, 3]}'
+        local path = os.tmpname()
+        local file = io.open(path, "wb")
+        file:write(prefix, string.rep("x", size - #prefix - #suffix), suffix)
+        file:close()
+        return path
+    end
+
+    for _, size in ipairs({1024 * 1024, 1024 * 1024 + 100, 2 * 1024 * 1024 - 10, 1024 * 1024 - 10}) do
+        it("should parse a file of " .. size .. " bytes", function()
+            local path = writeJson(size)
+            local expected = simdjson.parse(loadFile(path))
+            assert.are.same({1, 2, 3}, expected.last)
+            assert.are.same(expected, simdjson.parseFile(path))
+            assert.are.same(expected, simdjson.parseFile(path, {engine = "dom"}))
+            local document = simdjson.openFile(path)
+            assert.are.same({1, 2, 3}, document:atPointer("/last"))
+            document:close()
+            local count = 0
+            for document in simdjson.openManyFile(path, 4 * 1024 * 1024) do
+                assert.are.same(expected, document)
+                count = count + 1
+            end
+            assert.are.equal(1, count)
+            os.remove(path)
+        end)
+    end
+
+    it("should report files that cannot be read", function()
+        assert.has_error(function() simdjson.parseFile("jsonexamples/does-not-exist.json") end)
+        assert.has_error(function() simdjson.openFile("jsonexamples/does-not-exist.json") end)
+    end)
+end)
+
+describe("Make sure validate and minify work", function()
+    it("should accept every valid file", function()
+        for _, file in ipairs(files) do
+            assert.is_true(simdjson.validate(loadFile("jsonexamples/" .. file)))
+        end
+    end)
+
+    it("should report errors with their offset", function()
+        local valid, message, offset = simdjson.validate('{"a": [1, 2, tru]}')
+        assert.is_false(valid)
+        assert.is_string(message)
+        assert.are.equal(14, offset)
+
+        valid, message, offset = simdjson.validate('[1, 2, [3,, 4]]')
+        assert.is_false(valid)
+        assert.are.equal(11, offset)
+
+        assert.is_false(simdjson.validate('{"a": 1} 2'))
+
+        valid, message = simdjson.validate('{"a": "unterminated}')
+        assert.is_false(valid)
+        assert.is_string(message)
+        assert.is_false(simdjson.validate(""))
+    end)
+
+    it("should minify to the same document", function()
+        for _, file in ipairs(files) do
+            local fileContents = loadFile("jsonexamples/" .. file)
+            local minified = simdjson.minify(fileContents)
+            assert.is_true(#minified <= #fileContents)
+            assert.is_nil(minified:find("\n"))
+            assert.are.same(simdjson.parse(fileContents), simdjson.parse(minified))
+        end
+        assert.are.equal('{"a":[1,2,{"b":" x  y "}]}', simdjson.minify(' { "a" : [ 1 , 2 ,\n\t{ "b" : " x  y " } ] } '))
+        assert.are.equal("", simdjson.minify(""))
+        assert.has_error(function() simdjson.minify('{"a": "unterminated}') end)
+    end)
+end)
+
 describe("Make sure json pointer works with a string", function()
     it("should handle a string", function()
         local fileContents = loadFile("jsonexamples/small/demo.json")
@@ -69,6 +289,251 @@ describe("Make sure json pointer works with a string", function()
     end)
 end)
 
+describe("Make sure batched json pointers work", function()
+    local json = [[
+{
+    "a": {"b": [10, 20, {"c": "d"}], "e~f": 1, "g/h": 2},
+    "list": [1, 2, 3],
+    "dup": 1,
+    "dup": 2,
+    "n": null
+}
+]]
+
+    it("should return every pointer in order", function()
+        local decoded = simdjson.open(json)
+        local c, b, ef, gh, root, n, second = decoded:atPointers({
+            "/a/b/2/c", "/a/b", "/a/e~0f", "/a/g~1h", "", "/n", "/list/1"
+        })
+        assert.are.same("d", c)
+        assert.are.same({10, 20, {c = "d"}}, b)
+        assert.are.same(1, ef)
+        assert.are.same(2, gh)
+        assert.are.same(simdjson.parse(json), root)
+        assert.are.same(simdjson.null, n)
+        assert.are.same(2, second)
+    end)
+
+    it("should match atPointer", function()
+        local decoded = simdjson.openFile("jsonexamples/twitter.json")
+        local pointers = {"/statuses/3/user/screen_name", "/statuses/0/id", "/search_metadata",
+            "/statuses/3/user", "/statuses/3/user/id", "/statuses/0/id"}
+        local values = {decoded:atPointers(pointers)}
+        for i, pointer in ipairs(pointers) do
+            assert.are.same(decoded:atPointer(pointer), values[i])
+        end
+    end)
+
+    it("should resolve repeated keys like atPointer", function()
+        local decoded = simdjson.open(json)
+        assert.are.same(decoded:atPointer("/dup"), decoded:atPointers({"/dup"}))
+
+        local nested = '{"a": {"b": 1, "b": 2}, "c": [{"d": 1, "d": 2}]}'
+        decoded = simdjson.open(nested)
+        local a, b, c, d = decoded:atPointers({"/a", "/a/b", "/c", "/c/0/d"})
+        assert.are.same(simdjson.parse(nested).a, a)
+        assert.are.same(decoded:atPointer("/a/b"), b)
+        assert.are.same(simdjson.parse(nested).c, c)
+        assert.are.same(decoded:atPointer("/c/0/d"), d)
+    end)
+
+    it("should raise the errors of atPointer", function()
+        local decoded = simdjson.open(json)
+        assert.has_error(function() decoded:atPointers({"/a", "/missing"}) end)
+        assert.has_error(function() decoded:atPointers({"/list/3"}) end)
+        assert.has_error(function() decoded:atPointers({"a"}) end)
+        assert.has_error(function() decoded:atPointers({1}) end)
+        assert.are.same(20, decoded:atPointers({"/a/b/1"}))
+    end)
+end)
+
+describe("Make sure inputs parsed in place stay valid", function()
+    it("should parse strings of every length near a page boundary", function()
+        for length = 1, 200 do
+            local value = string.rep("x", length)
+            local json = '{"value": "' .. value .. '"}'
+            assert.are.equal(value, simdjson.parse(json).value)
+            assert.are.equal(value, simdjson.parse(json, {engine = "dom"}).value)
+            assert.are.equal(value, simdjson.open(json):atPointer("/value"))
+        end
+    end)
+
+    it("should keep the source string of an opened document alive", function()
+        local documents = {}
+        for i = 1, 50 do
+            documents[i] = simdjson.open(string.format('{"index": %d, "padding": "%s"}', i, string.rep("p", i * 37)))
+        end
+        collectgarbage()
+        collectgarbage()
+        for i = 1, 50 do
+            assert.are.equal(i, documents[i]:atPointer("/index"))
+        end
+    end)
+end)
+
+describe("Make sure compiled json pointers work", function()
+    local json = [[{"a": {"b": [10, {"c~d": "e", "f/g": null}]}, "h": true}]]
+
+    it("should match string pointers", function()
+        local document = simdjson.open(json)
+        for _, pointer in ipairs({"", "/a", "/a/b", "/a/b/0", "/a/b/1/c~0d", "/a/b/1/f~1g", "/h"}) do
+            local compiled = simdjson.compilePointer(pointer)
+            assert.are.equal(pointer, tostring(compiled))
+            assert.are.same(document:atPointer(pointer), document:atPointer(compiled))
+            assert.are.same(document:atPointer(pointer), document:at(compiled))
+            assert.are.same(document:atPointer(pointer), simdjson.extract(json, compiled))
+            assert.are.same(document:atPointer(pointer), simdjson.extract(json, pointer))
+        end
+    end)
+
+    it("should be reusable across documents", function()
+        local id = simdjson.compilePointer("/statuses/0/id")
+        local name = simdjson.compilePointer("/statuses/0/user/name")
+        local twitter = loadFile("jsonexamples/twitter.json")
+        local parsed = simdjson.parse(twitter)
+        for i = 1, 3 do
+            local first, second = simdjson.extract(twitter, id, name)
+            assert.are.equal(parsed.statuses[1].id, first)
+            assert.are.equal(parsed.statuses[1].user.name, second)
+        end
+        local document = simdjson.open(twitter)
+        assert.are.same({parsed.statuses[1].id, parsed.statuses[1].user.name}, {document:atPointers({id, name})})
+    end)
+
+    it("should raise the errors of string pointers", function()
+        local document = simdjson.open(json)
+        for _, pointer in ipairs({"/missing", "/a/b/2", "/a/b/x", "/a/b/-", "/a/b/01", "/h/i"}) do
+            assert.has_error(function() document:atPointer(pointer) end)
+            assert.has_error(function() document:atPointer(simdjson.compilePointer(pointer)) end)
+            assert.has_error(function() simdjson.extract(json, simdjson.compilePointer(pointer)) end)
+        end
+        assert.has_error(function() simdjson.compilePointer("a") end)
+        assert.has_error(function() simdjson.compilePointer("/a~2") end)
+        assert.has_error(function() simdjson.extract(json) end)
+        assert.has_error(function() simdjson.extract("{", "/a") end)
+    end)
+end)
+
+describe("Make sure JSONPath queries work", function()
+    local json = [[
+{
+    "store": {
+        "items": [
+            {"id": 1, "price": 8.5, "tags": ["a"], "name": "pen"},
+            {"id": 2, "price": 12, "tags": [], "name": "book", "sale": true},
+            {"id": 3, "price": 30, "name": "lamp", "sale": false},
+            {"id": 4, "name": "gift"}
+        ],
+        "owner": {"name": "ann", "id": 99}
+    },
+    "it's": [10, 20, 30, 40, 50]
+}
+]]
+
+    local document = simdjson.open(json)
+
+    it("should select children, indexes and wildcards", function()
+        assert.are.same({{id = 99, name = "ann"}}, document:query("$.store.owner"))
+        assert.are.same({"pen", "book", "lamp", "gift"}, document:query("$.store.items[*].name"))
+        assert.are.same({4, 1}, document:query("$.store.items[-1, 0].id"))
+        assert.are.same({"ann"}, document:query("$['store'][\"owner\"].name"))
+        assert.are.same({10, 20, 30, 40, 50}, document:query("$['it\\'s'].*"))
+        assert.are.same({}, document:query("$.store.missing[0]"))
+    end)
+
+    it("should select slices", function()
+        assert.are.same({20, 30}, document:query("$['it\\'s'][1:3]"))
+        assert.are.same({10, 30, 50}, document:query("$['it\\'s'][::2]"))
+        assert.are.same({40, 50}, document:query("$['it\\'s'][-2:]"))
+        assert.are.same({10, 20, 30}, document:query("$['it\\'s'][:-2]"))
+    end)
+
+    it("should descend recursively", function()
+        assert.are.same({1, 2, 3, 4, 99}, document:query("$..id"))
+        assert.are.same({"a"}, document:query("$..tags[0]"))
+    end)
+
+    it("should filter", function()
+        assert.are.same({2, 3}, document:query("$.store.items[?(@.price > 10)].id"))
+        assert.are.same({1, 2}, document:query("$.store.items[?(@.price <= 12)].id"))
+        assert.are.same({2}, document:query("$.store.items[?(@.sale == true)].id"))
+        assert.are.same({2, 3}, document:query("$.store.items[?(@.sale)].id"))
+        assert.are.same({1, 4}, document:query("$.store.items[?(@.name == 'pen' || @.name == \"gift\")].id"))
+        assert.are.same({3}, document:query("$.store.items[?(@.price > 10 && @.sale != true)].id"))
+        assert.are.same({1}, document:query("$.store.items[?(@.tags[0] == 'a')].id"))
+        assert.are.same({"ann"}, document:query("$..[?(@.id > 50)].name"))
+    end)
+
+    it("should match a lookup on parsed tables", function()
+        local catalog = simdjson.openFile("jsonexamples/citm_catalog.json")
+        local parsed = simdjson.parseFile("jsonexamples/citm_catalog.json")
+        local expected = {}
+        for _, performance in ipairs(parsed.performances) do
+            if performance.eventId > 138586400 then
+                expected[#expected + 1] = performance.id
+            end
+        end
+        assert.are.same(expected, catalog:query("$.performances[?(@.eventId > 138586400)].id"))
+        assert.are.same(expected, catalog:query("$.performances[?(@.eventId > 138586400)].id"))
+        assert.are.equal(#parsed.performances, #simdjson.open(loadFile("jsonexamples/citm_catalog.json")):query("$.performances.*"))
+    end)
+
+    it("should reject invalid expressions", function()
+        assert.has_error(function() document:query("store") end)
+        assert.has_error(function() document:query("$.store[") end)
+        assert.has_error(function() document:query("$[1:2:0]") end)
+        assert.has_error(function() document:query("$[?(@.a >)]") end)
+    end)
+end)
+
+describe("Make sure pooled parsers and close() work", function()
+    it("should reuse parsers across many documents", function()
+        local documents = {}
+        for i = 1, 100 do
+            local document = simdjson.open('{"index": ' .. i .. '}')
+            assert.are.equal(i, document:atPointer("/index"))
+            documents[#documents + 1] = document
+            if i % 3 == 0 then
+                document:close()
+                documents[#documents] = nil
+            end
+        end
+        for _, document in ipairs(documents) do
+            assert.is_number(document:atPointer("/index"))
+        end
+    end)
+
+    it("should reject lookups on closed documents", function()
+        local document = simdjson.openFile("jsonexamples/twitter.json")
+        local root = document:root()
+        local user = root.statuses[1].user
+        local name = user.screen_name
+        document:close()
+        document:close()
+        assert.has_error(function() document:atPointer("/statuses") end)
+        assert.has_error(function() document:atPointers({"/statuses"}) end)
+        assert.has_error(function() document:root() end)
+        assert.has_error(function() return root.search_metadata end)
+        assert.are.equal(name, user.screen_name)
+        assert.has_error(function() return user.name end)
+    end)
+
+    it("should configure the pool", function()
+        local size = simdjson.getParserPoolSize()
+        local capacity = simdjson.getParserPoolMaxCapacity()
+        simdjson.setParserPoolSize(0)
+        simdjson.setParserPoolMaxCapacity(1024)
+        assert.are.equal(0, simdjson.getParserPoolSize())
+        assert.are.equal(1024, simdjson.getParserPoolMaxCapacity())
+        simdjson.open("[1]"):close()
+        assert.are.same({1}, {simdjson.open("[1]"):atPointer("/0")})
+        assert.has_error(function() simdjson.setParserPoolSize(-1) end)
+        assert.has_error(function() simdjson.setParserPoolMaxCapacity("big") end)
+        simdjson.setParserPoolSize(size)
+        simdjson.setParserPoolMaxCapacity(capacity)
+    end)
+end)
+
 describe("Make sure json pointer works with openfile", function()
     it("should handle opening a file", function()
         local decodedFile = simdjson.openFile("jsonexamples/small/demo.json")
@@ -79,6 +544,252 @@ describe("Make sure json pointer works with openfile", function()
     end)
 end)
 
+describe("Make sure lazy proxies work", function()
+    it("should index nested values without converting the whole document", function()
+        local root = simdjson.openFile("jsonexamples/small/demo.json"):root()
+        local image = root.Image
+        assert.are.same("userdata", type(image))
+        assert.are.equal(800, image.Width)
+        assert.are.equal(125, image.Thumbnail.Height)
+        assert.are.equal(943, image.IDs[2])
+        assert.are.equal(4, #image.IDs)
+        assert.is_false(image.Animated)
+        assert.is_nil(image.Missing)
+        assert.is_nil(image.IDs[5])
+        assert.is_nil(image.IDs[0])
+        assert.is_nil(image.IDs.Width)
+        assert.are.equal(image, root.Image)
+    end)
+
+    it("should escape keys when building pointers", function()
+        local root = simdjson.open('{"a/b": {"c~d": [1, null]}}'):root()
+        assert.are.equal(1, root["a/b"]["c~d"][1])
+        assert.are.equal(simdjson.null, root["a/b"]["c~d"][2])
+    end)
+
+    it("should return scalar roots directly", function()
+        assert.are.equal(42, simdjson.open("42"):root())
+        assert.are.equal("text", simdjson.open('"text"'):root())
+    end)
+
+    it("should iterate arrays and objects", function()
+        local fileContents = loadFile("jsonexamples/small/demo.json")
+        local expected = cjson.decode(fileContents)
+        local root = simdjson.open(fileContents):root()
+
+        local ids = {}
+        for i = 1, #root.Image.IDs do
+            ids[i] = root.Image.IDs[i]
+        end
+        assert.are.same(expected.Image.IDs, ids)
+
+        if _VERSION ~= "Lua 5.1" then
+            local keys = {}
+            for key, value in pairs(root.Image) do
+                keys[#keys + 1] = key
+                if type(value) ~= "userdata" then
+                    assert.are.same(expected.Image[key], value)
+                end
+            end
+            table.sort(keys)
+            assert.are.same({"Animated", "Height", "IDs", "Thumbnail", "Title", "Width"}, keys)
+
+            local count = 0
+            for i, value in ipairs(root.Image.IDs) do
+                assert.are.equal(expected.Image.IDs[i], value)
+                count = count + 1
+            end
+            assert.are.equal(4, count)
+        end
+    end)
+
+    it("should look up adjacent elements one at a time", function()
+        local items = {}
+        for i = 1, 1000 do
+            items[i] = i * 2
+        end
+        local root = simdjson.open(simdjson.encode({items = items})):root()
+        local function memoized(proxy)
+            local count = 0
+            for _ in pairs(debug.getuservalue(proxy)[2]) do
+                count = count + 1
+            end
+            return count
+        end
+
+        local array = root.items
+        assert.are.equal(2, array[1])
+        assert.are.equal(4, array[2])
+        if debug.getuservalue then
+            assert.are.equal(2, memoized(array))
+        end
+        for i = 1, 10 do
+            assert.are.equal(i * 2, array[i])
+        end
+        if debug.getuservalue then
+            assert.are.equal(1000, memoized(array))
+        end
+    end)
+
+    it("should keep the document alive and be read-only", function()
+        local thumbnail = simdjson.openFile("jsonexamples/small/demo.json"):root().Image.Thumbnail
+        collectgarbage()
+        collectgarbage()
+        assert.are.equal(100, thumbnail.Width)
+        assert.has_error(function() thumbnail.Width = 1 end)
+    end)
+
+    it("should be collected together with its children", function()
+        local registry = debug.getregistry()
+        local function registrySize()
+            local size = 0
+            for _ in pairs(registry) do
+                size = size + 1
+            end
+            return size
+        end
+
+        local proxies = setmetatable({}, {__mode = "v"})
+        local function touch()
+            local root = simdjson.openFile("jsonexamples/twitter.json"):root()
+            local size = registrySize()
+            for i = 1, #root.statuses do
+                proxies[i] = root.statuses[i].user
+            end
+            assert.are.equal(size, registrySize())
+        end
+        touch()
+        collectgarbage()
+        assert.is_nil(next(proxies))
+    end)
+end)
+
+describe("Make sure multi-document streams work", function()
+    local ndjsonFile = "jsonexamples/amazon_cellphones.ndjson"
+
+    local function expectedDocuments()
+        local expected = {}
+        for line in loadFile(ndjsonFile):gmatch("[^\n]+") do
+            expected[#expected + 1] = cjson.decode(line)
+        end
+        return expected
+    end
+
+    it("should iterate the documents of a string", function()
+        local documents = {}
+        for document in simdjson.parseMany(loadFile(ndjsonFile)) do
+            documents[#documents + 1] = document
+        end
+        assert.are.same(expectedDocuments(), documents)
+    end)
+
+    it("should iterate the documents of a file", function()
+        local documents = {}
+        for document in simdjson.openManyFile(ndjsonFile, 64 * 1024) do
+            documents[#documents + 1] = document
+        end
+        assert.are.same(expectedDocuments(), documents)
+    end)
+
+    it("should handle scalars, small batches and parse() between documents", function()
+        local documents = {}
+        for document in simdjson.parseMany('1 "two" [3] {"four": 4} null', 32) do
+            assert.are.same({1}, simdjson.parse("[1]"))
+            documents[#documents + 1] = document
+        end
+        assert.are.same({1, "two", {3}, {four = 4}, simdjson.null}, documents)
+    end)
+
+    it("should stop after an invalid document", function()
+        local iterator = simdjson.parseMany('{"a": 1}\n{"b": tru}\n{"c": 3}')
+        assert.are.same({a = 1}, iterator())
+        assert.has_error(function() iterator() end)
+        assert.is_nil(iterator())
+    end)
+
+    it("should report a cut-off last document", function()
+        for _, input in ipairs({'{"a":1} [1,2', '{"a":1} {"b":'}) do
+            local iterator = simdjson.parseMany(input)
+            assert.are.same({a = 1}, iterator())
+            assert.has_error(function() iterator() end)
+            assert.is_nil(iterator())
+        end
+
+        local path = os.tmpname()
+        local file = io.open(path, "wb")
+        file:write(loadFile(ndjsonFile), '{"cut": [1, ')
+        file:close()
+        local count = 0
+        assert.has_error(function()
+            for _ in simdjson.openManyFile(path) do
+                count = count + 1
+            end
+        end)
+        os.remove(path)
+        assert.are.equal(#expectedDocuments(), count)
+    end)
+
+    it("should reject invalid batch sizes", function()
+        assert.has_error(function() simdjson.parseMany("{}", 0) end)
+    end)
+end)
+
+describe("Make sure asynchronous parsing works", function()
+    it("should match parse() for every file", function()
+        local handles = {}
+        for i, file in ipairs(files) do
+            handles[i] = simdjson.parseAsync(loadFile("jsonexamples/" .. file))
+        end
+        for i, file in ipairs(files) do
+            assert.are.same(simdjson.parse(loadFile("jsonexamples/" .. file)), handles[i]:wait())
+        end
+    end)
+
+    it("should return the same table from poll and repeated waits", function()
+        local handle = simdjson.parseAsync('{"a": [1, 2, 3]}')
+        local result = handle:poll()
+        while result == nil do
+            result = handle:poll()
+        end
+        assert.are.same({a = {1, 2, 3}}, result)
+        assert.are.equal(result, handle:wait())
+        assert.are.equal(result, handle:poll())
+    end)
+
+    it("should report errors when waiting", function()
+        local handle = simdjson.parseAsync('{"a": tru}')
+        assert.has_error(function() handle:wait() end)
+        assert.has_error(function() handle:wait() end)
+    end)
+
+    it("should survive handles that are never waited on", function()
+        for i = 1, 20 do
+            simdjson.parseAsync(loadFile("jsonexamples/twitter.json"))
+        end
+        collectgarbage()
+        assert.are.same({1}, simdjson.parseAsync("[1]"):wait())
+    end)
+
+    it("should configure the worker count", function()
+        local count = simdjson.getAsyncWorkerCount()
+        assert.are.equal(1, count)
+        assert.has_error(function() simdjson.setAsyncWorkerCount(0) end)
+        assert.has_error(function() simdjson.setAsyncWorkerCount(257) end)
+        simdjson.setAsyncWorkerCount(4)
+        assert.are.equal(4, simdjson.getAsyncWorkerCount())
+        local handles = {}
+        for i, file in ipairs(files) do
+            handles[i] = simdjson.parseAsync(loadFile("jsonexamples/" .. file))
+        end
+        simdjson.setAsyncWorkerCount(1)
+        for i, file in ipairs(files) do
+            assert.are.same(simdjson.parse(loadFile("jsonexamples/" .. file)), handles[i]:wait())
+        end
+        assert.are.same({1}, simdjson.parseAsync("[1]"):wait())
+        simdjson.setAsyncWorkerCount(count)
+    end)
+end)
+
 local major, minor = _VERSION:match('([%d]+)%.(%d+)')
 if tonumber(major) >= 5 and tonumber(minor) >= 3 then
     describe("Make sure ints and floats parse correctly", function ()
@@ -122,10 +833,13 @@ describe("Make sure invalid files are not accepted", function()
             local fileContents = loadFile("jsonexamples/invalid/" .. file)
             local cjsonValue, cjsonError = pcall(function() cjson.decode(fileContents) end)
             local simdjsonValue, simdjsonError = pcall(function() simdjson.parse(fileContents) end)
+            local domValue, domError = pcall(function() simdjson.parse(fileContents, {engine = "dom"}) end)
             assert.is.False(cjsonValue)
             assert.is.False(simdjsonValue)
+            assert.is.False(domValue)
             assert(cjsonError)
             assert(simdjsonError)
+            assert(domError)
         end)
     end
 end)
@@ -92,6 +92,386 @@ describe("simdjson.encode", function()
         assert.is_true(simdjson.parse(encoded).child.value)
     end)
 
+    it("pretty prints with the indent option", function()
+        assert.are.equal('[\n  1,\n  [\n    true\n  ],\n  {}\n]',
+            simdjson.encode({1, {true}, {}}, {indent = 2}))
+        assert.are.equal('{\n    "key": "value"\n}',
+            simdjson.encode({key = "value"}, {indent = 4}))
+        assert.are.equal('"scalar"', simdjson.encode("scalar", {indent = 2}))
+        assert.are.equal("[1,2]", simdjson.encode({1, 2}, {indent = 0}))
+
+        local value = {
+            name = "nested",
+            items = {{id = 1, tags = {"a", "b"}}, {id = 2, tags = {}}},
+            deep = {{{{{{{{{{"bottom"}}}}}}}}}}
+        }
+        local pretty = simdjson.encode(value, {indent = 16})
+        assert.are.same(simdjson.parse(simdjson.encode(value)), simdjson.parse(pretty))
+        assert.is_true(pretty:find("\n" .. string.rep(" ", 176) .. '"bottom"', 1, true) ~= nil)
+
+        assert.has_error(function()
+            simdjson.encode({}, {indent = -1})
+        end)
+        assert.has_error(function()
+            simdjson.encode({}, {indent = 17})
+        end)
+        assert.has_error(function()
+            simdjson.encode({}, {indent = "  "})
+        end)
+    end)
+
+    it("sorts object keys by byte order with sortKeys", function()
+        local value = {zeta = 1, alpha = {c = 3, b = 2, a = {z = true, y = false}},
+            beta = {3, 2, 1}, [10] = "ten", [2] = "two", [1.5] = "float", ["2"] = "string"}
+        local expected = '{"1.5":"float","10":"ten","2":"string","2":"two",' ..
+            '"alpha":{"a":{"y":false,"z":true},"b":2,"c":3},"beta":[3,2,1],"zeta":1}'
+
+        assert.are.equal(expected, simdjson.encode(value, {sortKeys = true}))
+        assert.are.equal('{\n  "a": 1,\n  "b": {}\n}',
+            simdjson.encode({b = {}, a = 1}, {sortKeys = true, indent = 2}))
+
+        local many = {}
+        for i = 1, 1000 do
+            many["key" .. i] = {i, {["v" .. i] = i}}
+        end
+        local first = simdjson.encode(many, {sortKeys = true})
+        many.key1 = nil
+        many.key1 = {1, {v1 = 1}}
+        assert.are.equal(first, simdjson.encode(many, {sortKeys = true}))
+        assert.is_true(first:find('^{"key1":') ~= nil)
+        assert.are.same(simdjson.parse(simdjson.encode(many)), simdjson.parse(first))
+
+        local long = string.rep("k", 64)
+        local nested = {}
+        local level = nested
+        for i = 1, 100 do
+            level[long .. "b"] = i
+            level[long .. "a"] = {}
+            level = level[long .. "a"]
+        end
+        local encoded = simdjson.encode(nested, {sortKeys = true})
+        assert.is_true(encoded:find('^{"' .. long .. 'a":{"' .. long .. 'a":') ~= nil)
+        assert.is_true(encoded:find('"' .. long .. 'b":1}$') ~= nil)
+        assert.are.same(simdjson.parse(simdjson.encode(nested)), simdjson.parse(encoded))
+
+        assert.has_error(function()
+            simdjson.encode({}, {sortKeys = 1})
+        end)
+        assert.has_error(function()
+            simdjson.encode({[true] = 1}, {sortKeys = true})
+        end)
+    end)
+
+    it("streams chunks to a function with encodeTo", function()
+        local value = {}
+        for i = 1, 2000 do
+            value[i] = {id = i, name = "record " .. i, tags = {"a", "b"}}
+        end
+
+        local chunks = {}
+        local written = simdjson.encodeTo(value, function(chunk)
+            chunks[#chunks + 1] = chunk
+        end, {bufferSize = 1024})
+        local output = table.concat(chunks)
+
+        assert.is_true(#chunks > 10)
+        assert.are.equal(#output, written)
+        for i = 1, #chunks - 1 do
+            assert.is_true(#chunks[i] >= 1024 and #chunks[i] < 1200)
+        end
+        assert.are.same(simdjson.parse(simdjson.encode(value)), simdjson.parse(output))
+
+        chunks = {}
+        simdjson.encodeTo({b = {2, 1}, a = "x"}, function(chunk)
+            chunks[#chunks + 1] = chunk
+            assert.are.equal('{"a":1,"b":2}', simdjson.encode({b = 2, a = 1}, {sortKeys = true}))
+        end, {sortKeys = true, indent = 2, bufferSize = 1})
+        assert.are.equal('{\n  "a": "x",\n  "b": [\n    2,\n    1\n  ]\n}', table.concat(chunks))
+        assert.are.equal(2, simdjson.encodeTo({}, function() end, {bufferSize = 8}))
+    end)
+
+    it("streams to file handles with encodeTo", function()
+        local file = io.tmpfile()
+        local written = simdjson.encodeTo({key = {1, 2, 3}}, file)
+        file:seek("set")
+        local output = file:read("*a")
+        assert.are.equal('{"key":[1,2,3]}', output)
+        assert.are.equal(#output, written)
+        file:close()
+
+        assert.has_error(function()
+            simdjson.encodeTo({}, file)
+        end)
+    end)
+
+    it("reports encodeTo errors and recovers", function()
+        assert.has_error(function()
+            simdjson.encodeTo({1, 2, 3}, function()
+                error("sink failed")
+            end, {bufferSize = 1})
+        end)
+        assert.has_error(function()
+            simdjson.encodeTo({"\255"}, function() end)
+        end)
+        assert.has_error(function()
+            simdjson.encodeTo({}, "not a sink")
+        end)
+        assert.has_error(function()
+            simdjson.encodeTo({}, -1)
+        end)
+        assert.has_error(function()
+            simdjson.encodeTo({}, function() end, {unknown = true})
+        end)
+
+        local chunks = {}
+        simdjson.encodeTo({valid = true}, function(chunk)
+            chunks[#chunks + 1] = chunk
+        end)
+        assert.are.equal('{"valid":true}', table.concat(chunks))
+    end)
+
+    it("trusts the raw length with arrayDetection = rawlen", function()
+        local options = {arrayDetection = "rawlen"}
+        local numbers = {}
+        for i = 1, 1000 do
+            numbers[i] = i / 4
+        end
+
+        assert.are.equal(simdjson.encode(numbers), simdjson.encode(numbers, options))
+        assert.are.equal('[[1,2],{"a":1},{}]', simdjson.encode({{1, 2}, {a = 1}, {}}, options))
+        assert.are.equal("[1,2]", simdjson.encode({1, 2, extra = true}, options))
+        assert.are.equal('{"1":1,"2":2,"extra":true}',
+            simdjson.encode({1, 2, extra = true}, {arrayDetection = "strict", sortKeys = true}))
+
+        assert.has_error(function()
+            simdjson.encode({}, {arrayDetection = "fast"})
+        end)
+        assert.has_error(function()
+            simdjson.encode({}, {arrayDetection = true})
+        end)
+    end)
+
+    it("encodes nesting deeper than 128 levels when allowed", function()
+        local root = {}
+        local current = root
+        for i = 1, 999 do
+            current[1] = {}
+            current = current[1]
+        end
+        current[1] = "bottom"
+
+        local encoded = simdjson.encode(root, {maxDepth = 1000})
+        assert.are.equal(string.rep("[", 1000) .. '"bottom"' .. string.rep("]", 1000), encoded)
+        assert.has_error(function()
+            simdjson.encode(root, {maxDepth = 999})
+        end)
+
+        current[1] = root
+        assert.has_error(function()
+            simdjson.encode(root, {maxDepth = 1024})
+        end)
+
+        simdjson.setMaxEncodeDepth(1024)
+        assert.are.equal(1024, simdjson.getMaxEncodeDepth())
+        assert.has_error(function()
+            simdjson.setMaxEncodeDepth(1025)
+        end)
+    end)
+
+    it("allows the same table at several places that are not nested", function()
+        local shared = {1, 2}
+        local value = {shared, shared, {inner = shared}}
+        for i = 1, 100 do
+            value[#value + 1] = {shared, {shared}}
+        end
+        assert.are.equal("[[1,2],[1,2],", simdjson.encode(value):sub(1, 13))
+    end)
+
+    it("writes repeated and escaped keys consistently", function()
+        local records = {}
+        for i = 1, 500 do
+            records[i] = {["quote\"key"] = i, ["tab\tkey"] = true, ["key" .. i] = i,
+                [string.rep("long", 40)] = i}
+        end
+        local decoded = simdjson.parse(simdjson.encode(records))
+        for i = 1, 500 do
+            assert.are.equal(i, decoded[i]["quote\"key"])
+            assert.is_true(decoded[i]["tab\tkey"])
+            assert.are.equal(i, decoded[i]["key" .. i])
+            assert.are.equal(i, decoded[i][string.rep("long", 40)])
+        end
+
+        local chunks = {}
+        simdjson.encodeTo(records, function(chunk)
+            chunks[#chunks + 1] = chunk
+            collectgarbage()
+        end, {bufferSize = 64, sortKeys = true})
+        assert.are.equal(simdjson.encode(records, {sortKeys = true}), table.concat(chunks))
+    end)
+
+    it("encodes into a reusable buffer with encodeBuffer", function()
+        local buffer = simdjson.encodeBuffer({key = "value"})
+        assert.are.equal('{"key":"value"}', buffer:tostring())
+        assert.are.equal('{"key":"value"}', tostring(buffer))
+        assert.are.equal(15, buffer:len())
+        assert.are.equal(15, #buffer)
+        local pointer, length = buffer:pointer()
+        assert.are.equal("userdata", type(pointer))
+        assert.are.equal(15, length)
+
+        local large = {}
+        for i = 1, 10000 do
+            large[i] = i
+        end
+        assert.are.equal(buffer, simdjson.encodeBuffer(large, buffer))
+        assert.are.equal(simdjson.encode(large), buffer:tostring())
+        assert.are.equal(buffer, simdjson.encodeBuffer({1, 2}, buffer, {indent = 1}))
+        assert.are.equal("[\n 1,\n 2\n]", buffer:tostring())
+
+        assert.has_error(function()
+            simdjson.encodeBuffer({"\255"}, buffer)
+        end)
+        assert.are.equal("", buffer:tostring())
+        assert.are.equal(0, buffer:len())
+
+        assert.has_error(function()
+            simdjson.encodeBuffer({}, {})
+        end)
+        assert.are.equal("{}", simdjson.encodeBuffer({}, nil, {bufferSize = 1}):tostring())
+    end)
+
+    it("encodes newline-delimited JSON with encodeLines", function()
+        local records = {}
+        for i = 1, 100 do
+            records[i] = {id = i, tags = {"a", "b"}}
+        end
+
+        local expected = {}
+        for i = 1, 100 do
+            expected[i] = simdjson.encode(records[i], {sortKeys = true}) .. "\n"
+        end
+        assert.are.equal(table.concat(expected), simdjson.encodeLines(records, {sortKeys = true}))
+        assert.are.equal('"a"\n1\nnull\n', simdjson.encodeLines({"a", 1, simdjson.null}))
+        assert.are.equal("", simdjson.encodeLines({}))
+
+        assert.has_error(function()
+            simdjson.encodeLines(records, {indent = 2})
+        end)
+        assert.has_error(function()
+            simdjson.encodeLines("not a table")
+        end)
+    end)
+
+    it("streams newline-delimited JSON through an encoder", function()
+        local encoder = simdjson.encoder({sortKeys = true})
+        encoder:write({b = 1, a = 2})
+        encoder:write("line")
+        assert.are.equal('{"a":2,"b":1}\n"line"\n', encoder:flush())
+        assert.are.equal("", encoder:flush())
+
+        local cyclic = {}
+        cyclic.self = cyclic
+        encoder:write({1})
+        assert.has_error(function()
+            encoder:write({ok = true, nested = cyclic})
+        end)
+        assert.has_error(function()
+            encoder:write({"\255"})
+        end)
+        encoder:write({2})
+        assert.are.equal("[1]\n[2]\n", encoder:flush())
+
+        for i = 1, 1000 do
+            encoder:write({id = i})
+        end
+        local lines = encoder:flush()
+        local count = 0
+        for line in lines:gmatch("[^\n]+") do
+            count = count + 1
+            assert.are.equal(count, simdjson.parse(line).id)
+        end
+        assert.are.equal(1000, count)
+
+        assert.has_error(function()
+            simdjson.encoder({indent = 2})
+        end)
+    end)
+
+    it("releases an oversized encode buffer after small encodes", function()
+        local large = string.rep("x", 4 * 1024 * 1024)
+        simdjson.encode(large)
+        assert.is_true(simdjson.getEncodeBufferCapacity() >= #large)
+
+        for i = 1, 15 do
+            simdjson.encode({i})
+            assert.is_true(simdjson.getEncodeBufferCapacity() >= #large)
+        end
+        for i = 1, 2 do
+            simdjson.encode({i})
+        end
+        assert.is_true(simdjson.getEncodeBufferCapacity() < 64 * 1024)
+
+        simdjson.encode({}, {bufferSize = 256 * 1024})
+        assert.is_true(simdjson.getEncodeBufferCapacity() >= 256 * 1024)
+
+        -- Steady large outputs keep their buffer.
+        local medium = string.rep("y", 512 * 1024)
+        for i = 1, 40 do
+            simdjson.encode(medium)
+        end
+        assert.is_true(simdjson.getEncodeBufferCapacity() >= #medium)
+        assert.are.equal(medium, simdjson.parse(simdjson.encode(medium)))
+    end)
+
+    it("validates UTF-8 in every string and key", function()
+        local valid = {["cl\195\169"] = "caf\195\169 \226\130\172 \240\159\152\128",
+            long = string.rep("\195\169", 100)}
+        assert.are.same(valid, simdjson.parse(simdjson.encode(valid)))
+
+        local invalid = {"\255", "\195", "abcdefgh\192\128", string.rep("a", 100) .. "\237\160\128"}
+        for _, value in ipairs(invalid) do
+            assert.has_error(function()
+                simdjson.encode({value})
+            end)
+            assert.has_error(function()
+                simdjson.encode({[value] = true})
+            end)
+            assert.has_error(function()
+                simdjson.encodeLines({value})
+            end)
+            assert.has_error(function()
+                simdjson.encodeTo({value}, function() end)
+            end)
+        end
+
+        -- Large outputs are validated in pieces as they are written.
+        local large = {}
+        for i = 1, 20000 do
+            large[i] = "caf\195\169 " .. i
+        end
+        assert.are.same(large, simdjson.parse(simdjson.encode(large)))
+        for _, position in ipairs({1, 10000, 20000}) do
+            local original = large[position]
+            large[position] = "\255"
+            assert.has_error(function()
+                simdjson.encode(large)
+            end)
+            large[position] = original
+        end
+    end)
+
+    it("skips UTF-8 validation with assumeValidUTF8", function()
+        assert.are.equal('"\255"', simdjson.encode("\255", {assumeValidUTF8 = true}))
+        assert.are.equal('{"\255":1}', simdjson.encode({["\255"] = 1}, {assumeValidUTF8 = true}))
+        assert.are.equal('"\255"\n', simdjson.encodeLines({"\255"}, {assumeValidUTF8 = true}))
+        assert.has_error(function()
+            simdjson.encode("\255", {assumeValidUTF8 = false})
+        end)
+        assert.has_error(function()
+            simdjson.encode("", {assumeValidUTF8 = "yes"})
+        end)
+    end)
+
     it("supports global encode settings", function()
         simdjson.setMaxEncodeDepth(64)
         simdjson.setEncodeBufferSize(1024)
@@ -0,0 +1,33 @@
+#ifndef LUA_SIMDJSON_COMPAT_H
+#define LUA_SIMDJSON_COMPAT_H
+
+#include <lua.hpp>
+
+#if !defined(luaL_newlibtable) && (!defined LUA_VERSION_NUM || LUA_VERSION_NUM <= 501)
+/*
+** set_funcs compat for 5.1
+** Stolen from: http://lua-users.org/wiki/CompatibilityWithLuaFive
+** Adapted from Lua 5.2.0
+*/
+static inline void luaL_setfuncs(lua_State *L, const luaL_Reg *l, int nup)
+{
+  luaL_checkstack(L, nup + 1, "too many upvalues");
+  for (; l->name != NULL; l++)
+  { /* fill the table with given functions */
+    int i;
+    lua_pushstring(L, l->name);
+    for (i = 0; i < nup; i++) /* copy upvalues to the top */
+      lua_pushvalue(L, -(nup + 1));
+    lua_pushcclosure(L, l->func, nup); /* closure with those upvalues */
+    lua_settable(L, -(nup + 3));
+  }
+  lua_pop(L, nup); /* remove upvalues */
+}
+#endif
+
+#if !defined LUA_VERSION_NUM || LUA_VERSION_NUM <= 501
+#define lua_setuservalue(L, idx) lua_setfenv(L, (idx))
+#define lua_getuservalue(L, idx) lua_getfenv(L, (idx))
+#endif
+
+#endif
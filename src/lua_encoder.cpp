@@ -1,31 +1,145 @@
 #include "lua_encoder.h"
 
+#include <algorithm>
+#include <cerrno>
 #include <climits>
 #include <cmath>
+#include <cstdint>
+#include <cstdio>
 #include <cstring>
 #include <memory>
 #include <new>
 #include <string_view>
+#include <vector>
 
 #include "simdjson.h"
+#include "lua_compat.h"
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 #define LUA_SIMDJSON_MAX_ENCODE_DEPTH_KEY "simdjson.maxEncodeDepth"
 #define LUA_SIMDJSON_ENCODE_BUFFER_SIZE_KEY "simdjson.encodeBufferSize"
 #define DEFAULT_MAX_ENCODE_DEPTH 128
-#define MAX_ENCODE_DEPTH 128
+#define MAX_ENCODE_DEPTH 1024
 #define DEFAULT_ENCODE_BUFFER_SIZE (16 * 1024)
 #define MAX_ENCODE_BUFFER_SIZE (64 * 1024 * 1024)
+#define MAX_ENCODE_INDENT 16
+// encode() remembers this many recent output sizes to size its buffer.
+#define ENCODE_SIZE_HISTORY 16
+// Output is validated as UTF-8 in pieces of about this size while it is still
+// in cache, rather than in a second pass over the whole result.
+#define UTF8_VALIDATION_CHUNK (64 * 1024)
+#define LUA_MYENCODESINK "EncodeSink"
+#define LUA_MYENCODEBUFFER "EncodeBuffer"
+#define LUA_MYENCODER "Encoder"
+#define KEY_CACHE_SLOTS 256
+#define KEY_CACHE_MAX_KEY_LENGTH 64
+#define KEY_CACHE_ARENA_SIZE (16 * 1024)
 
 namespace
 {
 thread_local std::unique_ptr<simdjson::builder::string_builder> encode_buffer;
-thread_local size_t encode_buffer_size = 0;
+// The largest size the buffer has held since it was allocated. The builder
+// only grows, so its capacity is at least this much.
+thread_local size_t encode_buffer_retained = 0;
+thread_local size_t encode_size_history[ENCODE_SIZE_HISTORY] = {};
+thread_local size_t encode_size_position = 0;
+
+// A key collected by serialize_append_sorted_object. String keys point into
+// the Lua string; number keys point at their text in encode_scratch. The
+// member's value is kept on the Lua stack at value_index, or is looked up
+// again by key when it is 0 because the stack could not grow.
+struct sorted_key
+{
+  const char *string;
+  size_t offset;
+  size_t length;
+  bool is_string;
+  bool is_integer;
+  lua_Integer integer;
+  lua_Number number;
+  int value_index;
+};
+
+// A slot of the open-addressed set of tables on the current path. A slot is
+// occupied only while its generation matches the set's, so starting a new
+// encode empties the set without clearing it.
+struct active_table_slot
+{
+  const void *table;
+  uint32_t generation;
+};
+
+// A direct-mapped cache entry for an object key. It maps the address of a
+// Lua string's bytes to its quoted and escaped form in the key arena.
+struct key_cache_slot
+{
+  const char *key;
+  uint32_t generation;
+  uint32_t offset;
+  uint32_t length;
+};
+
+// Scratch space for sortKeys, cycle detection and the key cache. encode()
+// uses the thread_local instance, while encodeTo() owns one so that a sink
+// callback can encode reentrantly.
+struct encode_scratch
+{
+  std::vector<sorted_key> sorted_keys;
+  std::unique_ptr<simdjson::builder::string_builder> number_keys;
+  std::vector<active_table_slot> active_tables;
+  uint32_t generation = 0;
+  key_cache_slot key_slots[KEY_CACHE_SLOTS] = {};
+  uint32_t key_generation = 0;
+  std::vector<char> key_arena;
+};
+
+thread_local encode_scratch thread_scratch;
+
+struct encode_options
+{
+  int max_depth;
+  size_t buffer_size;
+  int indent;
+  bool sort_keys;
+  bool trust_raw_length;
+  bool assume_valid_utf8;
+};
+
+enum class encode_sink_type
+{
+  function,
+  file,
+  descriptor
+};
+
+// Where encodeTo() sends each chunk once the builder holds chunk_size bytes.
+struct encode_sink
+{
+  encode_sink_type type;
+  int function_index;
+  FILE *file;
+  int descriptor;
+  size_t chunk_size;
+  size_t written;
+};
 
 struct encode_context
 {
   simdjson::builder::string_builder &builder;
+  encode_scratch &scratch;
+  encode_sink *sink;
   int max_depth;
-  const void *active_tables[MAX_ENCODE_DEPTH];
+  int indent;
+  bool sort_keys;
+  bool trust_raw_length;
+  bool validate_utf8;
+  // The output before this offset in the builder has been validated.
+  size_t validated;
   int active_table_count;
 };
 
@@ -39,7 +153,7 @@ static int absolute_index(lua_State *L, int index)
 }
 
 static lua_Integer check_integer(lua_State *L, int index, const char *name,
-                                 lua_Integer maximum)
+                                 lua_Integer minimum, lua_Integer maximum)
 {
   if (lua_type(L, index) != LUA_TNUMBER)
   {
@@ -47,10 +161,12 @@ static lua_Integer check_integer(lua_State *L, int index, const char *name,
   }
 
   lua_Number number = lua_tonumber(L, index);
-  if (!std::isfinite(number) || std::floor(number) != number || number < 1 ||
+  if (!std::isfinite(number) || std::floor(number) != number ||
+      number < static_cast<lua_Number>(minimum) ||
       number > static_cast<lua_Number>(maximum))
   {
-    luaL_error(L, "%s must be an integer between 1 and %lld", name,
+    luaL_error(L, "%s must be an integer between %lld and %lld", name,
+               static_cast<long long>(minimum),
                static_cast<long long>(maximum));
   }
   return static_cast<lua_Integer>(number);
@@ -58,14 +174,19 @@ static lua_Integer check_integer(lua_State *L, int index, const char *name,
 
 static int check_encode_depth(lua_State *L, int index, const char *name)
 {
-  return static_cast<int>(check_integer(L, index, name, MAX_ENCODE_DEPTH));
+  return static_cast<int>(check_integer(L, index, name, 1, MAX_ENCODE_DEPTH));
 }
 
 static size_t check_encode_buffer_size(lua_State *L, int index,
                                        const char *name)
 {
   return static_cast<size_t>(
-      check_integer(L, index, name, MAX_ENCODE_BUFFER_SIZE));
+      check_integer(L, index, name, 1, MAX_ENCODE_BUFFER_SIZE));
+}
+
+static int check_encode_indent(lua_State *L, int index, const char *name)
+{
+  return static_cast<int>(check_integer(L, index, name, 0, MAX_ENCODE_INDENT));
 }
 
 static bool is_known_option(lua_State *L, int index)
@@ -75,7 +196,15 @@ static bool is_known_option(lua_State *L, int index)
   return (length == sizeof("maxDepth") - 1 &&
           std::memcmp(key, "maxDepth", length) == 0) ||
          (length == sizeof("bufferSize") - 1 &&
-          std::memcmp(key, "bufferSize", length) == 0);
+          std::memcmp(key, "bufferSize", length) == 0) ||
+         (length == sizeof("indent") - 1 &&
+          std::memcmp(key, "indent", length) == 0) ||
+         (length == sizeof("sortKeys") - 1 &&
+          std::memcmp(key, "sortKeys", length) == 0) ||
+         (length == sizeof("arrayDetection") - 1 &&
+          std::memcmp(key, "arrayDetection", length) == 0) ||
+         (length == sizeof("assumeValidUTF8") - 1 &&
+          std::memcmp(key, "assumeValidUTF8", length) == 0);
 }
 
 static void validate_encode_options(lua_State *L, int table_index)
@@ -98,8 +227,24 @@ static void raw_get_field(lua_State *L, int table_index, const char *key)
   lua_rawget(L, absolute_index(L, table_index));
 }
 
-static void parse_encode_options(lua_State *L, int table_index, int &max_depth,
-                                 size_t &desired_buffer_size)
+static bool read_boolean_option(lua_State *L, int table_index,
+                                const char *name, bool value)
+{
+  raw_get_field(L, table_index, name);
+  if (!lua_isnil(L, -1))
+  {
+    if (lua_type(L, -1) != LUA_TBOOLEAN)
+    {
+      luaL_error(L, "%s must be a boolean", name);
+    }
+    value = lua_toboolean(L, -1) != 0;
+  }
+  lua_pop(L, 1);
+  return value;
+}
+
+static void parse_encode_options(lua_State *L, int table_index,
+                                 encode_options &options)
 {
   table_index = absolute_index(L, table_index);
   validate_encode_options(L, table_index);
@@ -107,17 +252,49 @@ static void parse_encode_options(lua_State *L, int table_index, int &max_depth,
   raw_get_field(L, table_index, "maxDepth");
   if (!lua_isnil(L, -1))
   {
-    max_depth = check_encode_depth(L, -1, "maxDepth");
+    options.max_depth = check_encode_depth(L, -1, "maxDepth");
   }
   lua_pop(L, 1);
 
   raw_get_field(L, table_index, "bufferSize");
   if (!lua_isnil(L, -1))
   {
-    desired_buffer_size =
+    options.buffer_size =
         check_encode_buffer_size(L, -1, "bufferSize");
   }
   lua_pop(L, 1);
+
+  raw_get_field(L, table_index, "indent");
+  if (!lua_isnil(L, -1))
+  {
+    options.indent = check_encode_indent(L, -1, "indent");
+  }
+  lua_pop(L, 1);
+
+  options.sort_keys =
+      read_boolean_option(L, table_index, "sortKeys", options.sort_keys);
+  options.assume_valid_utf8 = read_boolean_option(
+      L, table_index, "assumeValidUTF8", options.assume_valid_utf8);
+
+  raw_get_field(L, table_index, "arrayDetection");
+  if (!lua_isnil(L, -1))
+  {
+    const char *mode =
+        lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1) : "";
+    if (std::strcmp(mode, "rawlen") == 0)
+    {
+      options.trust_raw_length = true;
+    }
+    else if (std::strcmp(mode, "strict") == 0)
+    {
+      options.trust_raw_length = false;
+    }
+    else
+    {
+      luaL_error(L, "arrayDetection must be \"strict\" or \"rawlen\"");
+    }
+  }
+  lua_pop(L, 1);
 }
 
 static int read_max_encode_depth(lua_State *L)
@@ -170,14 +347,92 @@ static void write_encode_buffer_size(lua_State *L, size_t buffer_size)
   lua_rawset(L, LUA_REGISTRYINDEX);
 }
 
-// Return the array length for a dense 1..n table, or -1 for an object.
-// The raw sequence length lets non-array tables with no sequence part be
-// rejected after inspecting only their first entry. Tables that may be arrays
-// are traversed once to verify that they contain exactly the keys 1..n.
-static int get_table_array_size(lua_State *L, int table_index)
+// Resolve the global settings, overridden by the options table at
+// options_index when it is not 0.
+static encode_options read_encode_options(lua_State *L, int options_index)
 {
-  table_index = absolute_index(L, table_index);
+  encode_options options{read_max_encode_depth(L), read_encode_buffer_size(L),
+                         0, false, false, false};
+  if (options_index != 0)
+  {
+    luaL_checktype(L, options_index, LUA_TTABLE);
+    parse_encode_options(L, options_index, options);
+  }
+  return options;
+}
+
+// Forget every cached key. The cache is keyed by string address, which is
+// only meaningful while the strings are known to be alive.
+static void reset_key_cache(encode_scratch &scratch)
+{
+  if (++scratch.key_generation == 0)
+  {
+    std::fill(std::begin(scratch.key_slots), std::end(scratch.key_slots),
+              key_cache_slot{nullptr, 0, 0, 0});
+    scratch.key_generation = 1;
+  }
+  scratch.key_arena.clear();
+}
+
+static bool reset_encode_scratch(encode_scratch &scratch,
+                                 const encode_options &options)
+{
+  // Keep the active table set at most half full so probes stay short.
+  size_t table_slots = 16;
+  while (table_slots < static_cast<size_t>(options.max_depth) * 2)
+  {
+    table_slots *= 2;
+  }
+  if (scratch.active_tables.size() < table_slots || ++scratch.generation == 0)
+  {
+    try
+    {
+      scratch.active_tables.assign(
+          std::max(table_slots, scratch.active_tables.size()),
+          active_table_slot{nullptr, 0});
+    }
+    catch (const std::bad_alloc &)
+    {
+      return false;
+    }
+    scratch.generation = 1;
+  }
+
+  reset_key_cache(scratch);
+  if (scratch.key_arena.capacity() < KEY_CACHE_ARENA_SIZE)
+  {
+    try
+    {
+      scratch.key_arena.reserve(KEY_CACHE_ARENA_SIZE);
+    }
+    catch (const std::bad_alloc &)
+    {
+      return false;
+    }
+  }
+
+  if (options.sort_keys)
+  {
+    if (!scratch.number_keys)
+    {
+      scratch.number_keys.reset(
+          new (std::nothrow) simdjson::builder::string_builder());
+      if (!scratch.number_keys)
+      {
+        return false;
+      }
+    }
+    scratch.number_keys->clear();
+    scratch.sorted_keys.clear();
+  }
+  return true;
+}
 
+// Return the raw sequence length of a table, or -1 when it does not fit the
+// int indexes used by the array encoder. Such tables retain the object
+// encoding rather than narrowing the length.
+static int get_table_raw_length(lua_State *L, int table_index)
+{
   size_t raw_length;
 #if LUA_VERSION_NUM >= 502
   raw_length = lua_rawlen(L, table_index);
@@ -185,13 +440,26 @@ static int get_table_array_size(lua_State *L, int table_index)
   raw_length = lua_objlen(L, table_index);
 #endif
 
-  // The function and encoder array indexes use int, so larger tables retain
-  // the existing object encoding behavior rather than narrowing the length.
   if (raw_length > static_cast<size_t>(INT_MAX))
   {
     return -1;
   }
-  int hint = static_cast<int>(raw_length);
+  return static_cast<int>(raw_length);
+}
+
+// Return the array length for a dense 1..n table, or -1 for an object.
+// The raw sequence length lets non-array tables with no sequence part be
+// rejected after inspecting only their first entry. Tables that may be arrays
+// are traversed once to verify that they contain exactly the keys 1..n.
+static int get_table_array_size(lua_State *L, int table_index)
+{
+  table_index = absolute_index(L, table_index);
+
+  int hint = get_table_raw_length(L, table_index);
+  if (hint < 0)
+  {
+    return -1;
+  }
 
   if (hint == 0)
   {
@@ -242,12 +510,12 @@ static void serialize_data(lua_State *L, int value_index,
                            encode_context &context);
 
 static void serialize_append_number(lua_State *L, int index,
-                                    encode_context &context)
+                                    simdjson::builder::string_builder &builder)
 {
 #if LUA_VERSION_NUM >= 503
   if (lua_isinteger(L, index))
   {
-    context.builder.append(lua_tointeger(L, index));
+    builder.append(lua_tointeger(L, index));
     return;
   }
 #endif
@@ -256,7 +524,7 @@ static void serialize_append_number(lua_State *L, int index,
   {
     luaL_error(L, "cannot encode NaN or infinity as JSON");
   }
-  context.builder.append(value);
+  builder.append(value);
 }
 
 static void serialize_append_string(lua_State *L, int index,
@@ -268,23 +536,105 @@ static void serialize_append_string(lua_State *L, int index,
       std::string_view(value, length));
 }
 
-static void enter_table(lua_State *L, int table_index,
-                        encode_context &context)
+// Append a quoted object key. Records repeat the same keys, and the table
+// keeps each key string alive for the whole encode, so the escaped form is
+// cached by the address of the string's bytes and later copied in one go.
+static void append_object_key(encode_context &context, const char *key,
+                              size_t length)
+{
+  encode_scratch &scratch = context.scratch;
+  key_cache_slot &slot =
+      scratch.key_slots[(reinterpret_cast<uintptr_t>(key) >> 3 ^
+                         reinterpret_cast<uintptr_t>(key) >> 11) &
+                        (KEY_CACHE_SLOTS - 1)];
+  if (slot.key == key && slot.generation == scratch.key_generation)
+  {
+    context.builder.append_raw(scratch.key_arena.data() + slot.offset,
+                               slot.length);
+    return;
+  }
+
+  size_t start = context.builder.size();
+  context.builder.escape_and_append_with_quotes(std::string_view(key, length));
+  if (length > KEY_CACHE_MAX_KEY_LENGTH)
+  {
+    return;
+  }
+  std::string_view output;
+  if (context.builder.view().get(output))
+  {
+    return;
+  }
+  size_t escaped_length = output.size() - start;
+  size_t offset = scratch.key_arena.size();
+  // The arena never grows past its reserved capacity, so offsets stay valid.
+  if (offset + escaped_length > scratch.key_arena.capacity())
+  {
+    return;
+  }
+  scratch.key_arena.insert(scratch.key_arena.end(), output.data() + start,
+                           output.data() + output.size());
+  slot = key_cache_slot{key, scratch.key_generation,
+                        static_cast<uint32_t>(offset),
+                        static_cast<uint32_t>(escaped_length)};
+}
+
+// Start a new line indented for the given nesting level. Only called when
+// pretty printing, so compact output pays for a single branch per element.
+static void append_newline(encode_context &context, int level)
+{
+  static const char spaces[] = "                                ";
+  const size_t chunk = sizeof(spaces) - 1;
+
+  context.builder.append('\n');
+  size_t remaining = static_cast<size_t>(level) * context.indent;
+  while (remaining > chunk)
+  {
+    context.builder.append_raw(spaces, chunk);
+    remaining -= chunk;
+  }
+  context.builder.append_raw(spaces, remaining);
+}
+
+// Add a table to the set of tables on the current path and return its slot.
+// Tables leave in the reverse order they entered, so a slot can simply be
+// emptied again: no later probe sequence still depends on it.
+static size_t enter_table(lua_State *L, int table_index,
+                          encode_context &context)
 {
   const void *identity = lua_topointer(L, table_index);
-  for (int i = 0; i < context.active_table_count; i++)
+  std::vector<active_table_slot> &slots = context.scratch.active_tables;
+  uint32_t generation = context.scratch.generation;
+  size_t mask = slots.size() - 1;
+  size_t slot = static_cast<size_t>(
+                    ((reinterpret_cast<uintptr_t>(identity) >> 4) *
+                     UINT64_C(0x9E3779B97F4A7C15)) >>
+                    16) &
+                mask;
+  while (slots[slot].generation == generation)
   {
-    if (context.active_tables[i] == identity)
+    if (slots[slot].table == identity)
     {
       luaL_error(L, "cannot encode a cyclic table");
     }
+    slot = (slot + 1) & mask;
   }
   if (context.active_table_count >= context.max_depth)
   {
     luaL_error(L, "maximum nesting depth exceeded (limit: %d)",
                context.max_depth);
   }
-  context.active_tables[context.active_table_count++] = identity;
+  // Each level holds at most a key, a value and a looked up element.
+  luaL_checkstack(L, 3, "table nesting too deep to encode");
+  slots[slot] = active_table_slot{identity, generation};
+  context.active_table_count++;
+  return slot;
+}
+
+static void leave_table(encode_context &context, size_t slot)
+{
+  context.scratch.active_tables[slot].generation = 0;
+  context.active_table_count--;
 }
 
 static void serialize_append_array(lua_State *L, int table_index,
@@ -298,13 +648,52 @@ static void serialize_append_array(lua_State *L, int table_index,
     {
       context.builder.append_comma();
     }
+    if (context.indent != 0)
+    {
+      append_newline(context, context.active_table_count);
+    }
     lua_rawgeti(L, table_index, i);
     serialize_data(L, -1, context);
     lua_pop(L, 1);
   }
+  if (context.indent != 0)
+  {
+    append_newline(context, context.active_table_count - 1);
+  }
   context.builder.end_array();
 }
 
+static void begin_object_member(encode_context &context, bool first)
+{
+  if (!first)
+  {
+    context.builder.append_comma();
+  }
+  if (context.indent != 0)
+  {
+    append_newline(context, context.active_table_count);
+  }
+}
+
+static void append_member_colon(encode_context &context)
+{
+  context.builder.append_colon();
+  if (context.indent != 0)
+  {
+    context.builder.append(' ');
+  }
+}
+
+static void end_object_members(encode_context &context, bool empty)
+{
+  // Empty objects stay "{}" in both modes.
+  if (context.indent != 0 && !empty)
+  {
+    append_newline(context, context.active_table_count - 1);
+  }
+  context.builder.end_object();
+}
+
 static void serialize_append_object(lua_State *L, int table_index,
                                     encode_context &context)
 {
@@ -315,21 +704,20 @@ static void serialize_append_object(lua_State *L, int table_index,
 
   while (lua_next(L, table_index) != 0)
   {
-    if (!first)
-    {
-      context.builder.append_comma();
-    }
+    begin_object_member(context, first);
     first = false;
 
     int key_type = lua_type(L, -2);
     if (key_type == LUA_TSTRING)
     {
-      serialize_append_string(L, -2, context);
+      size_t length = 0;
+      const char *key = lua_tolstring(L, -2, &length);
+      append_object_key(context, key, length);
     }
     else if (key_type == LUA_TNUMBER)
     {
       context.builder.append('"');
-      serialize_append_number(L, -2, context);
+      serialize_append_number(L, -2, context.builder);
       context.builder.append('"');
     }
     else
@@ -338,11 +726,257 @@ static void serialize_append_object(lua_State *L, int table_index,
                  lua_typename(L, key_type));
     }
 
-    context.builder.append_colon();
+    append_member_colon(context);
     serialize_data(L, -1, context);
     lua_pop(L, 1);
   }
-  context.builder.end_object();
+  end_object_members(context, first);
+}
+
+static bool sorted_key_less(const sorted_key &left, const sorted_key &right,
+                            const char *number_text)
+{
+  const char *left_text =
+      left.is_string ? left.string : number_text + left.offset;
+  const char *right_text =
+      right.is_string ? right.string : number_text + right.offset;
+  int order = std::memcmp(left_text, right_text,
+                          std::min(left.length, right.length));
+  if (order != 0)
+  {
+    return order < 0;
+  }
+  if (left.length != right.length)
+  {
+    return left.length < right.length;
+  }
+  // A string key and a number key can share the same text, as in
+  // {["1"] = a, [1] = b}. Put the string first so the output is stable.
+  return left.is_string && !right.is_string;
+}
+
+// Emit the members of an object ordered by the bytes of their keys. The keys
+// are collected into the context's scratch array, which nested objects use as
+// a stack above this object's range, and number keys are formatted once into
+// its number_keys builder. Both keep their capacity across calls. The values
+// are left on the Lua stack by the lua_next pass, so emitting them needs no
+// second lookup; pushing the key again would create a new string on Lua 5.2+
+// for keys too long to be interned.
+static void serialize_append_sorted_object(lua_State *L, int table_index,
+                                           encode_context &context)
+{
+  table_index = absolute_index(L, table_index);
+  std::vector<sorted_key> &sorted_keys = context.scratch.sorted_keys;
+  simdjson::builder::string_builder &number_keys =
+      *context.scratch.number_keys;
+  size_t base = sorted_keys.size();
+  int top = lua_gettop(L);
+  // Leave room for the levels that enter_table may still add below this one.
+  int reserve = 3 * (context.max_depth - context.active_table_count + 1);
+
+  lua_pushnil(L);
+  while (lua_next(L, table_index) != 0)
+  {
+    sorted_key key{};
+    int key_type = lua_type(L, -2);
+    if (key_type == LUA_TSTRING)
+    {
+      // The table keeps its key strings alive until the object is emitted.
+      key.is_string = true;
+      key.string = lua_tolstring(L, -2, &key.length);
+    }
+    else if (key_type == LUA_TNUMBER)
+    {
+      key.offset = number_keys.size();
+#if LUA_VERSION_NUM >= 503
+      key.is_integer = lua_isinteger(L, -2) != 0;
+      key.integer = lua_tointeger(L, -2);
+#endif
+      key.number = lua_tonumber(L, -2);
+      serialize_append_number(L, -2, number_keys);
+      key.length = number_keys.size() - key.offset;
+    }
+    else
+    {
+      luaL_error(L, "unsupported key type in table for serialization: %s",
+                 lua_typename(L, key_type));
+    }
+    bool allocated = true;
+    try
+    {
+      sorted_keys.push_back(key);
+    }
+    catch (const std::bad_alloc &)
+    {
+      allocated = false;
+    }
+    if (!allocated)
+    {
+      luaL_error(L, "failed to allocate JSON encoder");
+    }
+    // Keep the value below the key, and fall back to looking it up by key
+    // once the stack reaches its limit (8000 slots on Lua 5.1, whose strings
+    // are all interned anyway).
+    if (lua_checkstack(L, reserve))
+    {
+      lua_insert(L, -2);
+      sorted_keys.back().value_index = lua_gettop(L) - 1;
+    }
+    else
+    {
+      lua_pop(L, 1);
+    }
+  }
+
+  std::string_view number_text;
+  if (number_keys.view().get(number_text))
+  {
+    luaL_error(L, "failed to allocate JSON encoder");
+  }
+  const char *number_data = number_text.data();
+  std::sort(sorted_keys.begin() + base, sorted_keys.end(),
+            [number_data](const sorted_key &left, const sorted_key &right)
+            { return sorted_key_less(left, right, number_data); });
+
+  context.builder.start_object();
+  size_t count = sorted_keys.size() - base;
+  for (size_t i = 0; i < count; i++)
+  {
+    // Nested objects may grow both scratch buffers, so copy the entry and
+    // resolve number text only when it is needed.
+    sorted_key key = sorted_keys[base + i];
+    begin_object_member(context, i == 0);
+    if (key.is_string)
+    {
+      append_object_key(context, key.string, key.length);
+    }
+    else
+    {
+      std::string_view text;
+      if (number_keys.view().get(text))
+      {
+        luaL_error(L, "failed to allocate JSON encoder");
+      }
+      context.builder.append('"');
+      context.builder.append_raw(text.data() + key.offset, key.length);
+      context.builder.append('"');
+    }
+    append_member_colon(context);
+    if (key.value_index != 0)
+    {
+      lua_pushvalue(L, key.value_index);
+    }
+    else
+    {
+      if (key.is_string)
+      {
+        lua_pushlstring(L, key.string, key.length);
+      }
+#if LUA_VERSION_NUM >= 503
+      else if (key.is_integer)
+      {
+        lua_pushinteger(L, key.integer);
+      }
+#endif
+      else
+      {
+        lua_pushnumber(L, key.number);
+      }
+      lua_rawget(L, table_index);
+    }
+    serialize_data(L, -1, context);
+    lua_pop(L, 1);
+  }
+  end_object_members(context, count == 0);
+  sorted_keys.resize(base);
+  lua_settop(L, top);
+}
+
+static bool write_descriptor(int descriptor, const char *data, size_t length)
+{
+  while (length > 0)
+  {
+#if defined(_WIN32)
+    unsigned int request =
+        length > INT_MAX ? INT_MAX : static_cast<unsigned int>(length);
+    int written = _write(descriptor, data, request);
+#else
+    ssize_t written = write(descriptor, data, length);
+#endif
+    if (written < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      return false;
+    }
+    data += written;
+    length -= static_cast<size_t>(written);
+  }
+  return true;
+}
+
+// Validate the output appended since the last call. It is called between
+// values, so no string is ever split across two calls.
+static void validate_pending_output(lua_State *L, encode_context &context)
+{
+  std::string_view output;
+  if (!context.validate_utf8 || context.builder.view().get(output))
+  {
+    return;
+  }
+  if (!simdjson::validate_utf8(output.data() + context.validated,
+                               output.size() - context.validated))
+  {
+    luaL_error(L, "encoded JSON contains invalid UTF-8 sequences");
+  }
+  context.validated = output.size();
+}
+
+// Hand the builder's contents to the sink and start a new chunk. Chunks end
+// between values, never inside a string.
+static void flush_encode_sink(lua_State *L, encode_context &context)
+{
+  std::string_view chunk;
+  auto error = context.builder.view().get(chunk);
+  if (error)
+  {
+    luaL_error(L, "failed to build JSON: %s", simdjson::error_message(error));
+  }
+  if (chunk.empty())
+  {
+    return;
+  }
+  validate_pending_output(L, context);
+
+  encode_sink &sink = *context.sink;
+  switch (sink.type)
+  {
+  case encode_sink_type::function:
+    lua_pushvalue(L, sink.function_index);
+    lua_pushlstring(L, chunk.data(), chunk.size());
+    lua_call(L, 1, 0);
+    // The callback can run the collector, so cached key addresses may now
+    // belong to other strings.
+    reset_key_cache(context.scratch);
+    break;
+  case encode_sink_type::file:
+    if (std::fwrite(chunk.data(), 1, chunk.size(), sink.file) != chunk.size())
+    {
+      luaL_error(L, "failed to write encoded JSON: %s", std::strerror(errno));
+    }
+    break;
+  case encode_sink_type::descriptor:
+    if (!write_descriptor(sink.descriptor, chunk.data(), chunk.size()))
+    {
+      luaL_error(L, "failed to write encoded JSON: %s", std::strerror(errno));
+    }
+    break;
+  }
+  sink.written += chunk.size();
+  context.builder.clear();
+  context.validated = 0;
 }
 
 static void serialize_data(lua_State *L, int value_index,
@@ -355,24 +989,32 @@ static void serialize_data(lua_State *L, int value_index,
     serialize_append_string(L, value_index, context);
     break;
   case LUA_TNUMBER:
-    serialize_append_number(L, value_index, context);
+    serialize_append_number(L, value_index, context.builder);
     break;
   case LUA_TBOOLEAN:
     context.builder.append(lua_toboolean(L, value_index) != 0);
     break;
   case LUA_TTABLE:
   {
-    enter_table(L, value_index, context);
-    int array_size = get_table_array_size(L, value_index);
+    size_t slot = enter_table(L, value_index, context);
+    // With arrayDetection = "rawlen" any table with a sequence part is an
+    // array, which skips the lua_next pass that proves it is dense.
+    int array_size = context.trust_raw_length
+                         ? get_table_raw_length(L, value_index)
+                         : get_table_array_size(L, value_index);
     if (array_size > 0)
     {
       serialize_append_array(L, value_index, array_size, context);
     }
+    else if (context.sort_keys)
+    {
+      serialize_append_sorted_object(L, value_index, context);
+    }
     else
     {
       serialize_append_object(L, value_index, context);
     }
-    context.active_table_count--;
+    leave_table(context, slot);
     break;
   }
   case LUA_TNIL:
@@ -392,52 +1034,486 @@ static void serialize_data(lua_State *L, int value_index,
     luaL_error(L, "unsupported Lua data type for serialization: %s",
                lua_typename(L, lua_type(L, value_index)));
   }
+
+  if (context.validate_utf8 &&
+      context.builder.size() - context.validated >= UTF8_VALIDATION_CHUNK)
+  {
+    validate_pending_output(L, context);
+  }
+  if (context.sink != nullptr &&
+      context.builder.size() >= context.sink->chunk_size)
+  {
+    flush_encode_sink(L, context);
+  }
 }
-} // namespace
 
-int encode(lua_State *L)
+// Per-call state of encodeTo(). It lives in a userdata so that it is released
+// by the collector when a sink or the value raises an error.
+struct encode_sink_state
 {
-  int argument_count = lua_gettop(L);
-  luaL_argcheck(L, argument_count >= 1 && argument_count <= 2, 1,
-                "expected 1 or 2 arguments");
+  simdjson::builder::string_builder builder;
+  encode_scratch scratch;
+
+  explicit encode_sink_state(size_t capacity) : builder(capacity) {}
+};
+
+static int encode_sink_state_delete(lua_State *L)
+{
+  auto *state =
+      static_cast<encode_sink_state *>(luaL_checkudata(L, 1, LUA_MYENCODESINK));
+  state->~encode_sink_state();
+  return 0;
+}
+
+static FILE *to_file_handle(lua_State *L, int index)
+{
+  void *handle = lua_touserdata(L, index);
+  if (handle == nullptr || !lua_getmetatable(L, index))
+  {
+    return nullptr;
+  }
+  luaL_getmetatable(L, LUA_FILEHANDLE);
+  bool is_file = lua_rawequal(L, -1, -2) != 0;
+  lua_pop(L, 2);
+  if (!is_file)
+  {
+    return nullptr;
+  }
+#if LUA_VERSION_NUM >= 502
+  auto *stream = static_cast<luaL_Stream *>(handle);
+  if (stream->closef == nullptr)
+  {
+    luaL_error(L, "attempt to use a closed file");
+  }
+  return stream->f;
+#else
+  FILE *file = *static_cast<FILE **>(handle);
+  if (file == nullptr)
+  {
+    luaL_error(L, "attempt to use a closed file");
+  }
+  return file;
+#endif
+}
 
-  int max_depth = read_max_encode_depth(L);
-  size_t desired_buffer_size = read_encode_buffer_size(L);
-  if (argument_count == 2)
+static void check_encode_sink(lua_State *L, int index, encode_sink &sink)
+{
+  sink = encode_sink{encode_sink_type::function, index, nullptr, -1, 0, 0};
+  switch (lua_type(L, index))
+  {
+  case LUA_TFUNCTION:
+    return;
+  case LUA_TNUMBER:
+    sink.type = encode_sink_type::descriptor;
+    sink.descriptor =
+        static_cast<int>(check_integer(L, index, "file descriptor", 0, INT_MAX));
+    return;
+  case LUA_TUSERDATA:
+    sink.file = to_file_handle(L, index);
+    if (sink.file != nullptr)
+    {
+      sink.type = encode_sink_type::file;
+      return;
+    }
+    break;
+  }
+  luaL_argerror(L, index,
+                "expected a file handle, a file descriptor or a function");
+}
+
+// Serialize the value at value_index into builder with the thread's scratch
+// space and return the output, which stays in the builder.
+static std::string_view encode_value(lua_State *L, int value_index,
+                                     simdjson::builder::string_builder &builder,
+                                     const encode_options &options)
+{
+  if (!reset_encode_scratch(thread_scratch, options))
+  {
+    luaL_error(L, "failed to allocate JSON encoder");
+  }
+
+  builder.clear();
+  encode_context context{builder,          thread_scratch,
+                         nullptr,          options.max_depth,
+                         options.indent,   options.sort_keys,
+                         options.trust_raw_length,
+                         !options.assume_valid_utf8, 0, 0};
+  serialize_data(L, value_index, context);
+  validate_pending_output(L, context);
+
+  std::string_view json;
+  auto error = builder.view().get(json);
+  if (error)
+  {
+    luaL_error(L, "failed to build JSON: %s", simdjson::error_message(error));
+  }
+  return json;
+}
+
+// A reusable output buffer for encodeBuffer(). length is the size of the last
+// successful encode, so a failed refill leaves the buffer empty rather than
+// exposing partial output.
+struct EncodeBuffer
+{
+  simdjson::builder::string_builder builder;
+  size_t length;
+
+  explicit EncodeBuffer(size_t capacity) : builder(capacity), length(0) {}
+};
+
+static EncodeBuffer *check_encode_buffer(lua_State *L, int index)
+{
+  return static_cast<EncodeBuffer *>(
+      luaL_checkudata(L, index, LUA_MYENCODEBUFFER));
+}
+
+static const char *encode_buffer_data(EncodeBuffer *buffer)
+{
+  std::string_view output;
+  if (buffer->length == 0 || buffer->builder.view().get(output))
   {
-    luaL_checktype(L, 2, LUA_TTABLE);
-    parse_encode_options(L, 2, max_depth, desired_buffer_size);
+    return "";
   }
+  return output.data();
+}
+
+static int EncodeBuffer_tostring(lua_State *L)
+{
+  EncodeBuffer *buffer = check_encode_buffer(L, 1);
+  lua_pushlstring(L, encode_buffer_data(buffer), buffer->length);
+  return 1;
+}
 
-  if (!encode_buffer || encode_buffer_size != desired_buffer_size)
+static int EncodeBuffer_len(lua_State *L)
+{
+  EncodeBuffer *buffer = check_encode_buffer(L, 1);
+  lua_pushinteger(L, static_cast<lua_Integer>(buffer->length));
+  return 1;
+}
+
+static int EncodeBuffer_pointer(lua_State *L)
+{
+  EncodeBuffer *buffer = check_encode_buffer(L, 1);
+  lua_pushlightuserdata(L, const_cast<char *>(encode_buffer_data(buffer)));
+  lua_pushinteger(L, static_cast<lua_Integer>(buffer->length));
+  return 2;
+}
+
+static int EncodeBuffer_delete(lua_State *L)
+{
+  check_encode_buffer(L, 1)->~EncodeBuffer();
+  return 0;
+}
+
+// Each newline-delimited record must stay on a single line.
+static void check_line_options(lua_State *L, const encode_options &options)
+{
+  if (options.indent != 0)
+  {
+    luaL_error(L, "indent cannot be used for newline-delimited JSON");
+  }
+}
+
+// Return the thread's encode buffer. The previous output is still in the
+// builder, so its size is recorded here whether that encode succeeded or not.
+// The buffer is reallocated when it is smaller than the requested initial
+// size, or when it retains more than four times what recent encodes needed,
+// so one huge encode does not pin its memory for the life of the thread. A
+// new buffer is sized for the largest of the recent outputs, with headroom.
+static simdjson::builder::string_builder &
+prepare_encode_buffer(lua_State *L, size_t buffer_size)
+{
+  size_t recent = 0;
+  if (encode_buffer)
+  {
+    size_t last = encode_buffer->size();
+    encode_buffer_retained = std::max(encode_buffer_retained, last);
+    encode_size_history[encode_size_position++ % ENCODE_SIZE_HISTORY] = last;
+    recent = *std::max_element(std::begin(encode_size_history),
+                               std::end(encode_size_history));
+  }
+
+  size_t target = std::max(buffer_size, recent + recent / 4);
+  if (!encode_buffer || encode_buffer_retained < buffer_size ||
+      encode_buffer_retained / 4 > target)
   {
-    auto *replacement = new (std::nothrow)
-        simdjson::builder::string_builder(desired_buffer_size);
+    // Release the old buffer first so that both are never held at once.
+    encode_buffer.reset();
+    encode_buffer_retained = 0;
+    auto *replacement =
+        new (std::nothrow) simdjson::builder::string_builder(target);
     if (replacement == nullptr)
     {
-      return luaL_error(L, "failed to allocate JSON encoder");
+      luaL_error(L, "failed to allocate JSON encoder");
     }
     encode_buffer.reset(replacement);
-    encode_buffer_size = desired_buffer_size;
+    encode_buffer_retained = target;
   }
+  return *encode_buffer;
+}
 
-  encode_buffer->clear();
-  encode_context context{*encode_buffer, max_depth, {}, 0};
-  serialize_data(L, 1, context);
+// The stream object returned by simdjson.encoder(). Options are resolved once
+// when it is created. committed is the length of the complete lines in the
+// builder; a write that fails leaves a partial line after it, which is cut
+// off before the builder is used again.
+struct Encoder
+{
+  simdjson::builder::string_builder builder;
+  encode_scratch scratch;
+  encode_options options;
+  size_t committed;
 
-  std::string_view json;
-  auto error = encode_buffer->view().get(json);
+  explicit Encoder(const encode_options &encoder_options)
+      : builder(encoder_options.buffer_size), options(encoder_options),
+        committed(0)
+  {
+  }
+};
+
+static Encoder *check_encoder(lua_State *L, int index)
+{
+  return static_cast<Encoder *>(luaL_checkudata(L, index, LUA_MYENCODER));
+}
+
+static std::string_view encoder_lines(lua_State *L, Encoder *encoder)
+{
+  std::string_view output;
+  auto error = encoder->builder.view().get(output);
+  if (error)
+  {
+    luaL_error(L, "failed to build JSON: %s", simdjson::error_message(error));
+  }
+  if (output.size() == encoder->committed)
+  {
+    return output;
+  }
+
+  bool allocated = true;
+  try
+  {
+    std::string lines(output.data(), encoder->committed);
+    encoder->builder.clear();
+    encoder->builder.append_raw(lines.data(), lines.size());
+  }
+  catch (const std::bad_alloc &)
+  {
+    allocated = false;
+  }
+  if (!allocated || encoder->builder.view().get(output))
+  {
+    luaL_error(L, "failed to allocate JSON encoder");
+  }
+  return output;
+}
+
+static int Encoder_write(lua_State *L)
+{
+  Encoder *encoder = check_encoder(L, 1);
+  luaL_checkany(L, 2);
+  lua_settop(L, 2);
+
+  // Drop any partial line left by a failed write.
+  size_t start = encoder_lines(L, encoder).size();
+  // Cached keys are only valid while their strings are known to be alive,
+  // which between writes they are not.
+  if (!reset_encode_scratch(encoder->scratch, encoder->options))
+  {
+    return luaL_error(L, "failed to allocate JSON encoder");
+  }
+  const encode_options &options = encoder->options;
+  encode_context context{encoder->builder, encoder->scratch,
+                         nullptr,          options.max_depth,
+                         options.indent,   options.sort_keys,
+                         options.trust_raw_length,
+                         !options.assume_valid_utf8, start, 0};
+  serialize_data(L, 2, context);
+  validate_pending_output(L, context);
+  encoder->builder.append('\n');
+
+  std::string_view output;
+  auto error = encoder->builder.view().get(output);
+  if (error)
+  {
+    return luaL_error(L, "failed to build JSON: %s",
+                      simdjson::error_message(error));
+  }
+  encoder->committed = output.size();
+  return 0;
+}
+
+static int Encoder_flush(lua_State *L)
+{
+  Encoder *encoder = check_encoder(L, 1);
+  std::string_view lines = encoder_lines(L, encoder);
+  lua_pushlstring(L, lines.data(), lines.size());
+  encoder->builder.clear();
+  encoder->committed = 0;
+  return 1;
+}
+
+static int Encoder_delete(lua_State *L)
+{
+  check_encoder(L, 1)->~Encoder();
+  return 0;
+}
+
+static const struct luaL_Reg encoder_m[] = {
+    {"write", Encoder_write},
+    {"flush", Encoder_flush},
+    {"__gc", Encoder_delete},
+    {NULL, NULL}};
+
+static const struct luaL_Reg encode_buffer_m[] = {
+    {"tostring", EncodeBuffer_tostring},
+    {"len", EncodeBuffer_len},
+    {"pointer", EncodeBuffer_pointer},
+    {"__tostring", EncodeBuffer_tostring},
+    {"__len", EncodeBuffer_len},
+    {"__gc", EncodeBuffer_delete},
+    {NULL, NULL}};
+} // namespace
+
+int encode(lua_State *L)
+{
+  int argument_count = lua_gettop(L);
+  luaL_argcheck(L, argument_count >= 1 && argument_count <= 2, 1,
+                "expected 1 or 2 arguments");
+
+  encode_options options =
+      read_encode_options(L, argument_count == 2 ? 2 : 0);
+
+  std::string_view json = encode_value(
+      L, 1, prepare_encode_buffer(L, options.buffer_size), options);
+  lua_pushlstring(L, json.data(), json.size());
+  return 1;
+}
+
+int encode_lines(lua_State *L)
+{
+  int argument_count = lua_gettop(L);
+  luaL_argcheck(L, argument_count >= 1 && argument_count <= 2, 1,
+                "expected 1 or 2 arguments");
+  luaL_checktype(L, 1, LUA_TTABLE);
+
+  encode_options options =
+      read_encode_options(L, argument_count == 2 ? 2 : 0);
+  check_line_options(L, options);
+  simdjson::builder::string_builder &builder =
+      prepare_encode_buffer(L, options.buffer_size);
+  if (!reset_encode_scratch(thread_scratch, options))
+  {
+    return luaL_error(L, "failed to allocate JSON encoder");
+  }
+
+  // Every record shares one context: the table set and key cache stay valid
+  // because the array keeps all of its records alive.
+  builder.clear();
+  encode_context context{builder,          thread_scratch,
+                         nullptr,          options.max_depth,
+                         options.indent,   options.sort_keys,
+                         options.trust_raw_length,
+                         !options.assume_valid_utf8, 0, 0};
+  int count = get_table_raw_length(L, 1);
+  if (count < 0)
+  {
+    return luaL_error(L, "too many values to encode");
+  }
+  for (int i = 1; i <= count; i++)
+  {
+    lua_rawgeti(L, 1, i);
+    serialize_data(L, -1, context);
+    lua_pop(L, 1);
+    builder.append('\n');
+  }
+  validate_pending_output(L, context);
+
+  std::string_view lines;
+  auto error = builder.view().get(lines);
   if (error)
   {
     return luaL_error(L, "failed to build JSON: %s",
                       simdjson::error_message(error));
   }
-  if (!encode_buffer->validate_unicode())
+  lua_pushlstring(L, lines.data(), lines.size());
+  return 1;
+}
+
+int new_encoder(lua_State *L)
+{
+  int argument_count = lua_gettop(L);
+  luaL_argcheck(L, argument_count <= 1, 2, "expected 0 or 1 arguments");
+
+  encode_options options =
+      read_encode_options(L, argument_count == 1 ? 1 : 0);
+  check_line_options(L, options);
+  void *memory = lua_newuserdata(L, sizeof(Encoder));
+  new (memory) Encoder(options);
+  luaL_getmetatable(L, LUA_MYENCODER);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+int encode_buffer_value(lua_State *L)
+{
+  int argument_count = lua_gettop(L);
+  luaL_argcheck(L, argument_count >= 1 && argument_count <= 3, 1,
+                "expected 1 to 3 arguments");
+
+  encode_options options =
+      read_encode_options(L, argument_count == 3 ? 3 : 0);
+
+  EncodeBuffer *buffer;
+  if (lua_isnoneornil(L, 2))
+  {
+    lua_settop(L, 1);
+    void *memory = lua_newuserdata(L, sizeof(EncodeBuffer));
+    buffer = new (memory) EncodeBuffer(options.buffer_size);
+    luaL_getmetatable(L, LUA_MYENCODEBUFFER);
+    lua_setmetatable(L, -2);
+  }
+  else
   {
-    return luaL_error(L, "encoded JSON contains invalid UTF-8 sequences");
+    buffer = check_encode_buffer(L, 2);
+    lua_settop(L, 2);
   }
 
-  lua_pushlstring(L, json.data(), json.size());
+  buffer->length = 0;
+  buffer->length = encode_value(L, 1, buffer->builder, options).size();
+  return 1;
+}
+
+int encode_to(lua_State *L)
+{
+  int argument_count = lua_gettop(L);
+  luaL_argcheck(L, argument_count >= 2 && argument_count <= 3, 1,
+                "expected 2 or 3 arguments");
+
+  encode_sink sink;
+  check_encode_sink(L, 2, sink);
+  encode_options options =
+      read_encode_options(L, argument_count == 3 ? 3 : 0);
+  sink.chunk_size = options.buffer_size;
+  lua_settop(L, 3);
+
+  void *memory = lua_newuserdata(L, sizeof(encode_sink_state));
+  auto *state = new (memory) encode_sink_state(options.buffer_size);
+  luaL_getmetatable(L, LUA_MYENCODESINK);
+  lua_setmetatable(L, -2);
+
+  if (!reset_encode_scratch(state->scratch, options))
+  {
+    return luaL_error(L, "failed to allocate JSON encoder");
+  }
+
+  encode_context context{state->builder,   state->scratch,
+                         &sink,            options.max_depth,
+                         options.indent,   options.sort_keys,
+                         options.trust_raw_length,
+                         !options.assume_valid_utf8, 0, 0};
+  serialize_data(L, 1, context);
+  flush_encode_sink(L, context);
+
+  lua_pushinteger(L, static_cast<lua_Integer>(sink.written));
   return 1;
 }
 
@@ -468,3 +1544,34 @@ int get_encode_buffer_size(lua_State *L)
                   static_cast<lua_Integer>(read_encode_buffer_size(L)));
   return 1;
 }
+
+int get_encode_buffer_capacity(lua_State *L)
+{
+  size_t capacity = 0;
+  if (encode_buffer)
+  {
+    capacity = std::max(encode_buffer_retained, encode_buffer->size());
+  }
+  lua_pushinteger(L, static_cast<lua_Integer>(capacity));
+  return 1;
+}
+
+void register_encoder_types(lua_State *L)
+{
+  luaL_newmetatable(L, LUA_MYENCODESINK);
+  lua_pushcfunction(L, encode_sink_state_delete);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, LUA_MYENCODEBUFFER);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_setfuncs(L, encode_buffer_m, 0);
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, LUA_MYENCODER);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_setfuncs(L, encoder_m, 0);
+  lua_pop(L, 1);
+}
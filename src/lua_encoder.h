@@ -4,9 +4,15 @@
 #include <lua.hpp>
 
 int encode(lua_State *L);
+int encode_to(lua_State *L);
+int encode_buffer_value(lua_State *L);
+int encode_lines(lua_State *L);
+int new_encoder(lua_State *L);
 int set_max_encode_depth(lua_State *L);
 int get_max_encode_depth(lua_State *L);
 int set_encode_buffer_size(lua_State *L);
 int get_encode_buffer_size(lua_State *L);
+int get_encode_buffer_capacity(lua_State *L);
+void register_encoder_types(lua_State *L);
 
 #endif
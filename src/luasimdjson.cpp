@@ -1,47 +1,102 @@
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <condition_variable>
+#include <cstdint>
 #include <cstring>
+#include <deque>
 #include <lua.hpp>
 #include <lauxlib.h>
 #include <limits>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define LUA_SIMDJSON_MAPPED_INPUT 1
+#define LUA_SIMDJSON_HAS_FORK 1
+#else
+#define LUA_SIMDJSON_MAPPED_INPUT 0
+#define LUA_SIMDJSON_HAS_FORK 0
+#endif
 
 #define NDEBUG
 #define __OPTIMIZE__ 1
 
 #include "simdjson.h"
+#include "lua_compat.h"
 #include "luasimdjson.h"
 
 #define LUA_SIMDJSON_NAME "simdjson"
 #define LUA_SIMDJSON_VERSION "0.0.9"
+// matches simdjson's DEFAULT_MAX_DEPTH, which the parsers enforce as well
+#define LUA_SIMDJSON_MAX_PARSE_DEPTH 1024
+#define LUA_SIMDJSON_STACK_LEVELS_PER_CHECK 32
 
 using namespace simdjson;
 
-#if !defined(luaL_newlibtable) && (!defined LUA_VERSION_NUM || LUA_VERSION_NUM <= 501)
-/*
-** set_funcs compat for 5.1
-** Stolen from: http://lua-users.org/wiki/CompatibilityWithLuaFive
-** Adapted from Lua 5.2.0
-*/
-static void luaL_setfuncs(lua_State *L, const luaL_Reg *l, int nup)
-{
-  luaL_checkstack(L, nup + 1, "too many upvalues");
-  for (; l->name != NULL; l++)
-  { /* fill the table with given functions */
-    int i;
-    lua_pushstring(L, l->name);
-    for (i = 0; i < nup; i++) /* copy upvalues to the top */
-      lua_pushvalue(L, -(nup + 1));
-    lua_pushcclosure(L, l->func, nup); /* closure with those upvalues */
-    lua_settable(L, -(nup + 3));
-  }
-  lua_pop(L, nup); /* remove upvalues */
-}
+// Sanitizers report the in-place padding reads below even though they cannot
+// fault, so instrumented builds always copy their input.
+#if defined(__SANITIZE_ADDRESS__)
+#define LUA_SIMDJSON_IN_PLACE_INPUT 0
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(memory_sanitizer)
+#define LUA_SIMDJSON_IN_PLACE_INPUT 0
+#endif
+#endif
+#ifndef LUA_SIMDJSON_IN_PLACE_INPUT
+#define LUA_SIMDJSON_IN_PLACE_INPUT 1
 #endif
 
+// No supported platform maps memory in pages smaller than this, and larger
+// pages are multiples of it.
+#define LUA_SIMDJSON_MIN_PAGE_SIZE 4096
+
 thread_local ondemand::parser ondemand_parser;
+thread_local dom::parser dom_parser;
 thread_local std::unique_ptr<char[]> parse_buffer;
 thread_local size_t parse_buffer_capacity = 0;
 
+// simdjson only needs the SIMDJSON_PADDING bytes after the input to be
+// readable; their contents are ignored. Reading them cannot fault when they
+// end on the same page as the last byte of the input, so such strings can be
+// parsed where Lua stored them.
+static bool can_parse_in_place(const char *data, size_t length)
+{
+#if LUA_SIMDJSON_IN_PLACE_INPUT
+  if (length == 0)
+  {
+    return false;
+  }
+  uintptr_t last = reinterpret_cast<uintptr_t>(data + length - 1);
+  return (last % LUA_SIMDJSON_MIN_PAGE_SIZE) + SIMDJSON_PADDING <
+         LUA_SIMDJSON_MIN_PAGE_SIZE;
+#else
+  (void)data;
+  (void)length;
+  return false;
+#endif
+}
+
+static simdjson::padded_string_view in_place_view(const char *data,
+                                                  size_t length)
+{
+  return simdjson::padded_string_view(data, length, length + SIMDJSON_PADDING);
+}
+
 static simdjson::padded_string_view copy_to_padded_buffer(lua_State *L,
                                                           const char *data,
                                                           size_t length)
@@ -70,270 +125,3833 @@ static simdjson::padded_string_view copy_to_padded_buffer(lua_State *L,
                                       parse_buffer_capacity);
 }
 
-template <typename T>
-void convert_ondemand_element_to_table(lua_State *L, T &element)
+// Files smaller than this are read into memory: for them, setting up and
+// tearing down a mapping costs more than the copy it saves.
+#define LUA_SIMDJSON_MIN_MAPPED_FILE_SIZE (1024 * 1024)
+
+// The contents of a JSON file. Large files are mapped read-only instead of
+// being copied into a padded_string, so they are paged in straight from the
+// page cache and never held in memory twice. The mapped file must not be
+// truncated while it is in use.
+class json_file_input
 {
-  static_assert(std::is_base_of<ondemand::document, T>::value || std::is_base_of<ondemand::value, T>::value, "type parameter must be document or value");
+public:
+  json_file_input() = default;
+  json_file_input(const json_file_input &) = delete;
+  json_file_input &operator=(const json_file_input &) = delete;
+  ~json_file_input() { this->release(); }
 
-  switch (element.type())
+  // Throws simdjson_error(IO_ERROR) if the file cannot be read.
+  void load(const char *path)
   {
+    this->release();
+#if LUA_SIMDJSON_MAPPED_INPUT
+    if (this->map(path))
+    {
+      return;
+    }
+#endif
+    this->copy = padded_string::load(path);
+  }
 
-  case ondemand::json_type::array:
+  simdjson::padded_string_view view() const
   {
-    int count = 1;
-    lua_newtable(L);
-
-    for (ondemand::value child : element.get_array())
+    if (this->mapping != nullptr)
     {
-      lua_pushinteger(L, count);
-      convert_ondemand_element_to_table(L, child);
-      lua_settable(L, -3);
-      count = count + 1;
+      return simdjson::padded_string_view(
+          static_cast<const char *>(this->mapping), this->length,
+          this->mapping_length);
     }
-    break;
+    return simdjson::padded_string_view(this->copy);
   }
 
-  case ondemand::json_type::object:
-    lua_newtable(L);
-    for (ondemand::field field : element.get_object())
+  void release()
+  {
+#if LUA_SIMDJSON_MAPPED_INPUT
+    if (this->mapping != nullptr)
     {
-      std::string_view s = field.unescaped_key();
-      lua_pushlstring(L, s.data(), s.size());
-      convert_ondemand_element_to_table(L, field.value());
-      lua_settable(L, -3);
+      munmap(this->mapping, this->mapping_length);
     }
-    break;
+#endif
+    this->mapping = nullptr;
+    this->mapping_length = 0;
+    this->length = 0;
+    this->copy = padded_string();
+  }
 
-  case ondemand::json_type::number:
+private:
+#if LUA_SIMDJSON_MAPPED_INPUT
+  // Returns false if the file should be read instead.
+  bool map(const char *path)
   {
-    ondemand::number number = element.get_number();
-    ondemand::number_type number_type = number.get_number_type();
-    switch (number_type)
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
     {
-    case SIMDJSON_BUILTIN_IMPLEMENTATION::number_type::floating_point_number:
-      lua_pushnumber(L, element.get_double());
-      break;
+      throw simdjson_error(IO_ERROR);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) ||
+        info.st_size < LUA_SIMDJSON_MIN_MAPPED_FILE_SIZE ||
+        static_cast<uint64_t>(info.st_size) >
+            std::numeric_limits<size_t>::max() / 2)
+    {
+      ::close(fd);
+      return false;
+    }
 
-    case SIMDJSON_BUILTIN_IMPLEMENTATION::number_type::signed_integer:
-      lua_pushinteger(L, element.get_int64());
-      break;
+    size_t size = static_cast<size_t>(info.st_size);
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t file_pages = (size + page - 1) / page * page;
+    size_t padded_pages = (size + SIMDJSON_PADDING + page - 1) / page * page;
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    // The parser reads every byte, so fault the whole file in up front.
+    flags |= MAP_POPULATE;
+#endif
 
-    case SIMDJSON_BUILTIN_IMPLEMENTATION::number_type::unsigned_integer:
+    void *mapping = MAP_FAILED;
+    if (padded_pages == file_pages)
     {
-// a uint64 can be greater than an int64, so we must check how large and pass as a number
-// if larger but LUA_MAXINTEGER (which is only defined in 5.3+)
-#if defined(LUA_MAXINTEGER)
-      uint64_t actual_value = element.get_uint64();
-      if (actual_value > LUA_MAXINTEGER)
-      {
-        lua_pushnumber(L, actual_value);
-      }
-      else
+      // The zero-filled tail of the last page holds the padding.
+      mapping = mmap(nullptr, size, PROT_READ, flags, fd, 0);
+    }
+    else
+    {
+      // The file ends too close to a page boundary for its last page to hold
+      // the padding, so it is mapped over the start of an anonymous
+      // reservation that supplies readable pages after it.
+      void *reserved = mmap(nullptr, padded_pages, PROT_READ,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (reserved != MAP_FAILED)
       {
-        lua_pushinteger(L, actual_value);
+        mapping = mmap(reserved, size, PROT_READ, flags | MAP_FIXED, fd, 0);
+        if (mapping == MAP_FAILED)
+        {
+          munmap(reserved, padded_pages);
+        }
       }
-#else
-      lua_pushnumber(L, element.get_double());
-#endif
-      break;
     }
-
-    case SIMDJSON_BUILTIN_IMPLEMENTATION::number_type::big_integer:
-      lua_pushnumber(L, element.get_double());
-      break;
+    ::close(fd);
+    if (mapping == MAP_FAILED)
+    {
+      return false;
     }
-    break;
-  }
+#if !defined(MAP_POPULATE) && defined(MADV_WILLNEED)
+    madvise(mapping, size, MADV_WILLNEED);
+#endif
 
-  case ondemand::json_type::string:
-  {
-    std::string_view s = element.get_string();
-    lua_pushlstring(L, s.data(), s.size());
-    break;
+    this->mapping = mapping;
+    this->mapping_length = padded_pages;
+    this->length = size;
+    return true;
   }
+#endif
 
-  case ondemand::json_type::boolean:
-    lua_pushboolean(L, element.get_bool());
-    break;
+  simdjson::padded_string copy;
+  void *mapping = nullptr;
+  size_t mapping_length = 0;
+  size_t length = 0;
+};
 
-  case ondemand::json_type::null:
-    // calling is_null().value() will trigger an exception if the value is invalid
-    if (element.is_null().value())
+enum class parse_engine
+{
+  ondemand,
+  // Builds simdjson's tape first. The tape records the size of every
+  // container, so each table is created at its final size without a separate
+  // counting pass.
+  dom
+};
+
+// A JSON pointer reference token with its "~0" and "~1" escapes undone, and
+// its value as an array index worked out once.
+struct pointer_token
+{
+  std::string key;
+  // SUCCESS if key is an array index, otherwise the error at_pointer reports
+  // when the token is applied to an array.
+  error_code index_error;
+  size_t index;
+};
+
+// Sets the index fields of token from its key. Indexes longer than 18 digits
+// cannot name an element of any array simdjson can parse.
+static void parse_pointer_index(pointer_token &token)
+{
+  token.index = 0;
+  token.index_error = SUCCESS;
+  if (token.key == "-")
+  {
+    token.index_error = INDEX_OUT_OF_BOUNDS;
+    return;
+  }
+  if (token.key.empty() || (token.key[0] == '0' && token.key.size() > 1))
+  {
+    token.index_error = INVALID_JSON_POINTER;
+  }
+  for (char c : token.key)
+  {
+    if (c < '0' || c > '9')
     {
-      lua_pushlightuserdata(L, NULL);
+      token.index_error = INCORRECT_TYPE;
+      return;
     }
-    break;
-
-  case ondemand::json_type::unknown:
-  default:
-    luaL_error(L, "simdjson::ondemand::json_type::unknown or unsupported type encountered");
-    break;
+    token.index = token.index * 10 + static_cast<size_t>(c - '0');
+  }
+  if (token.index_error == SUCCESS && token.key.size() > 18)
+  {
+    token.index_error = INDEX_OUT_OF_BOUNDS;
   }
 }
 
-static int parse(lua_State *L)
+// Splits a JSON pointer such as "/items/0/a~1b" into tokens. Returns false if
+// it is not a valid JSON pointer.
+static bool read_pointer(std::string_view pointer,
+                         std::vector<pointer_token> &tokens)
 {
-  size_t json_str_len;
-  const char *json_str = luaL_checklstring(L, 1, &json_str_len);
-
-  ondemand::document doc;
-
-  try
+  tokens.clear();
+  if (!pointer.empty() && pointer[0] != '/')
   {
-    // Lua owns json_str and does not guarantee simdjson's required trailing
-    // padding. Copy it into reusable padded storage before parsing.
-    doc = ondemand_parser.iterate(
-        copy_to_padded_buffer(L, json_str, json_str_len));
-    convert_ondemand_element_to_table(L, doc);
+    return false;
   }
-  catch (simdjson::simdjson_error &error)
+  size_t position = 0;
+  while (position < pointer.size())
   {
-    luaL_error(L, error.what());
+    size_t end = pointer.find('/', position + 1);
+    if (end == std::string_view::npos)
+    {
+      end = pointer.size();
+    }
+    tokens.emplace_back();
+    std::string &key = tokens.back().key;
+    for (size_t i = position + 1; i < end; i++)
+    {
+      if (pointer[i] != '~')
+      {
+        key += pointer[i];
+      }
+      else if (i + 1 < end && (pointer[i + 1] == '0' || pointer[i + 1] == '1'))
+      {
+        key += pointer[i + 1] == '0' ? '~' : '/';
+        i++;
+      }
+      else
+      {
+        return false;
+      }
+    }
+    parse_pointer_index(tokens.back());
+    position = end;
   }
-
-  return 1;
+  return true;
 }
 
-static int parse_file(lua_State *L)
+// Reused between calls, so tokens are never leaked when an error unwinds past
+// them.
+thread_local std::vector<pointer_token> pointer_tokens;
+
+// A set of JSON pointers stored as a tree of reference tokens, so that a
+// document can be searched for all of them in one pass. The only option and
+// atPointers each use the fields marked for them.
+struct pointer_tree
 {
-  const char *json_file = luaL_checkstring(L, 1);
+  // The token leading to this node from its parent.
+  pointer_token token;
+  std::map<std::string, std::unique_ptr<pointer_tree>, std::less<>> children;
+  // The children whose token is an array index, ordered by that index, so an
+  // array is matched by walking it and this list in step.
+  std::vector<std::pair<size_t, pointer_tree *>> elements;
+  // only: the value at this path is converted in full.
+  bool whole = false;
+  // only: the paths below a "*" token, which matches every key of an object
+  // and every index of an array.
+  std::unique_ptr<pointer_tree> any;
+  // atPointers: positions in the argument list of the pointers that end here.
+  std::vector<int> slots;
+  // atPointers: set once the value at this path has been found, so repeated
+  // object keys resolve to their first occurrence, as with at_pointer.
+  bool visited = false;
 
-  padded_string json_string;
-  ondemand::document doc;
+  void clear()
+  {
+    children.clear();
+    elements.clear();
+    whole = false;
+    any.reset();
+    slots.clear();
+    visited = false;
+  }
 
-  try
+  pointer_tree &child(const pointer_token &token)
   {
-    json_string = padded_string::load(json_file);
-    doc = ondemand_parser.iterate(json_string);
-    convert_ondemand_element_to_table(L, doc);
+    std::unique_ptr<pointer_tree> &child = children[token.key];
+    if (!child)
+    {
+      child.reset(new pointer_tree());
+      child->token = token;
+      if (token.index_error == SUCCESS)
+      {
+        std::pair<size_t, pointer_tree *> element(token.index, child.get());
+        elements.insert(
+            std::upper_bound(elements.begin(), elements.end(), element),
+            element);
+      }
+    }
+    return *child;
   }
-  catch (simdjson::simdjson_error &error)
+
+  const pointer_tree *find(std::string_view key) const
   {
-    luaL_error(L, error.what());
+    auto child = children.find(key);
+    return child != children.end() ? child->second.get() : any.get();
   }
+};
 
-  return 1;
-}
+struct parse_options
+{
+  // Count array elements and object fields before creating each table so it
+  // can be allocated at its final size instead of growing by rehashing.
+  bool presize = false;
+  parse_engine engine = parse_engine::ondemand;
+  // Set when only the listed paths should be converted.
+  const pointer_tree *only = nullptr;
+};
 
-static int active_implementation(lua_State *L)
+// Reused between calls, so a projection is never leaked when an error
+// unwinds past it.
+thread_local pointer_tree parse_projection;
+
+static int absolute_index(lua_State *L, int index)
 {
-  const auto &implementation = simdjson::get_active_implementation();
-  std::string name = implementation->name();
-  const std::string description = implementation->description();
-  const std::string implementation_name = name + " (" + description + ")";
+  if (index > 0 || index <= LUA_REGISTRYINDEX)
+  {
+    return index;
+  }
+  return lua_gettop(L) + index + 1;
+}
 
-  lua_pushlstring(L, implementation_name.data(), implementation_name.size());
+static bool is_option_name(const char *key, size_t length, const char *name)
+{
+  return length == std::strlen(name) && std::memcmp(key, name, length) == 0;
+}
 
-  return 1;
+static bool is_known_parse_option(lua_State *L, int index)
+{
+  size_t length = 0;
+  const char *key = lua_tolstring(L, index, &length);
+  return is_option_name(key, length, "presize") ||
+         is_option_name(key, length, "engine") ||
+         is_option_name(key, length, "only");
 }
 
-// ParsedObject as C++ class
-#define LUA_MYOBJECT "ParsedObject"
-class ParsedObject
+static bool check_boolean_option(lua_State *L, int index, const char *name)
 {
-private:
-  simdjson::padded_string json_string;
-  ondemand::document doc;
-  std::unique_ptr<ondemand::parser> parser;
+  if (lua_type(L, index) != LUA_TBOOLEAN)
+  {
+    luaL_error(L, "%s must be a boolean", name);
+  }
+  return lua_toboolean(L, index) != 0;
+}
 
-public:
-  ParsedObject(const char *json_file)
-      : json_string(padded_string::load(json_file)),
-        parser(new ondemand::parser{})
+// Adds the path of a JSON pointer such as "/items/*/price" to the projection.
+static void add_projection_pointer(lua_State *L, pointer_tree &root,
+                                   std::string_view pointer)
+{
+  std::vector<pointer_token> &tokens = pointer_tokens;
+  if (!read_pointer(pointer, tokens))
   {
-    this->doc = this->parser.get()->iterate(json_string);
+    luaL_error(L, "only must list JSON pointers");
   }
-  ParsedObject(const char *json_str, size_t json_str_len)
-      : json_string(json_str, json_str_len),
-        parser(new ondemand::parser{})
+  pointer_tree *node = &root;
+  for (const pointer_token &token : tokens)
   {
-    this->doc = this->parser.get()->iterate(json_string);
+    if (token.key == "*")
+    {
+      if (!node->any)
+      {
+        node->any.reset(new pointer_tree());
+        node->any->token = token;
+      }
+      node = node->any.get();
+    }
+    else
+    {
+      node = &node->child(token);
+    }
   }
-  ~ParsedObject() {}
-  ondemand::document *get_doc() { return &(this->doc); }
-};
+  node->whole = true;
+}
 
-static int ParsedObject_delete(lua_State *L)
+// Copies the paths below src into dst.
+static void merge_projection(pointer_tree &dst, const pointer_tree &src)
 {
-  delete *reinterpret_cast<ParsedObject **>(lua_touserdata(L, 1));
-  return 0;
+  dst.whole = dst.whole || src.whole;
+  for (const auto &child : src.children)
+  {
+    merge_projection(dst.child(child.second->token), *child.second);
+  }
+  if (src.any)
+  {
+    if (!dst.any)
+    {
+      dst.any.reset(new pointer_tree());
+      dst.any->token = src.any->token;
+    }
+    merge_projection(*dst.any, *src.any);
+  }
 }
 
-static int ParsedObject_open(lua_State *L)
+// A key matched by name is also matched by a sibling "*", so the "*" paths
+// are merged into every named sibling. Lookups then need a single node.
+static void finish_projection(pointer_tree &node)
 {
-  size_t json_str_len;
-  const char *json_str = luaL_checklstring(L, 1, &json_str_len);
-
-  try
+  for (auto &child : node.children)
   {
-    ParsedObject **parsedObject =
-        (ParsedObject **)(lua_newuserdata(L, sizeof(ParsedObject *)));
-    *parsedObject = new ParsedObject(json_str, json_str_len);
-    luaL_getmetatable(L, LUA_MYOBJECT);
-    lua_setmetatable(L, -2);
+    if (node.any)
+    {
+      merge_projection(*child.second, *node.any);
+    }
+    finish_projection(*child.second);
   }
-  catch (simdjson::simdjson_error &error)
+  if (node.any)
   {
-    luaL_error(L, error.what());
+    finish_projection(*node.any);
   }
-  return 1;
 }
 
-static int ParsedObject_open_file(lua_State *L)
+static void read_projection(lua_State *L, int index, pointer_tree &root)
 {
-  const char *json_file = luaL_checkstring(L, 1);
-
-  try
+  if (lua_type(L, index) != LUA_TTABLE)
   {
-    ParsedObject **parsedObject =
-        (ParsedObject **)(lua_newuserdata(L, sizeof(ParsedObject *)));
-    *parsedObject = new ParsedObject(json_file);
-    luaL_getmetatable(L, LUA_MYOBJECT);
-    lua_setmetatable(L, -2);
+    luaL_error(L, "only must be a table of JSON pointers");
   }
-  catch (simdjson::simdjson_error &error)
+  root.clear();
+  for (int i = 1;; i++)
   {
-    luaL_error(L, error.what());
+    lua_rawgeti(L, index, i);
+    if (lua_isnil(L, -1))
+    {
+      lua_pop(L, 1);
+      break;
+    }
+    if (lua_type(L, -1) != LUA_TSTRING)
+    {
+      luaL_error(L, "only must be a table of JSON pointers");
+    }
+    size_t length = 0;
+    const char *pointer = lua_tolstring(L, -1, &length);
+    add_projection_pointer(L, root, std::string_view(pointer, length));
+    lua_pop(L, 1);
   }
-
-  return 1;
+  finish_projection(root);
 }
 
-static int ParsedObject_atPointer(lua_State *L)
+// Reads the optional options table passed as the last argument of parse()
+// and parseFile(). Unknown keys are rejected so typos do not silently fall
+// back to the defaults.
+static void read_parse_options(lua_State *L, int table_index,
+                               parse_options &options)
 {
-  ondemand::document *document =
-      (*reinterpret_cast<ParsedObject **>(luaL_checkudata(L, 1, LUA_MYOBJECT)))
-          ->get_doc();
-  const char *pointer = luaL_checkstring(L, 2);
+  if (lua_isnoneornil(L, table_index))
+  {
+    return;
+  }
+  luaL_checktype(L, table_index, LUA_TTABLE);
+  table_index = absolute_index(L, table_index);
 
-  try
+  lua_pushnil(L);
+  while (lua_next(L, table_index) != 0)
   {
-    ondemand::value returned_element = document->at_pointer(pointer);
-    convert_ondemand_element_to_table(L, returned_element);
+    if (lua_type(L, -2) != LUA_TSTRING || !is_known_parse_option(L, -2))
+    {
+      luaL_error(L, "unknown parse option");
+    }
+    lua_pop(L, 1);
   }
-  catch (simdjson::simdjson_error &error)
+
+  lua_pushstring(L, "presize");
+  lua_rawget(L, table_index);
+  if (!lua_isnil(L, -1))
   {
-    luaL_error(L, error.what());
+    options.presize = check_boolean_option(L, -1, "presize");
   }
+  lua_pop(L, 1);
 
-  return 1;
+  lua_pushstring(L, "engine");
+  lua_rawget(L, table_index);
+  if (!lua_isnil(L, -1))
+  {
+    size_t length = 0;
+    const char *engine = lua_type(L, -1) == LUA_TSTRING
+                             ? lua_tolstring(L, -1, &length)
+                             : nullptr;
+    if (engine != nullptr && is_option_name(engine, length, "ondemand"))
+    {
+      options.engine = parse_engine::ondemand;
+    }
+    else if (engine != nullptr && is_option_name(engine, length, "dom"))
+    {
+      options.engine = parse_engine::dom;
+    }
+    else
+    {
+      luaL_error(L, "engine must be \"ondemand\" or \"dom\"");
+    }
+  }
+  lua_pop(L, 1);
+
+  lua_pushstring(L, "only");
+  lua_rawget(L, table_index);
+  if (!lua_isnil(L, -1))
+  {
+    if (options.engine == parse_engine::dom)
+    {
+      luaL_error(L, "only is not supported by the dom engine");
+    }
+    pointer_tree &projection = parse_projection;
+    read_projection(L, lua_gettop(L), projection);
+    options.only = &projection;
+  }
+  lua_pop(L, 1);
 }
 
-static int ParsedObject_newindex(lua_State *L)
+// lua_createtable takes int sizes; larger counts are only a hint, so they are
+// clamped rather than rejected.
+static int table_size_hint(size_t count)
 {
-  luaL_error(L, "This should be treated as a read-only table. We may one day add array access for the elements, and it'll likely not be modifiable.");
-  return 1;
+  return count > static_cast<size_t>(INT_MAX) ? INT_MAX
+                                                : static_cast<int>(count);
+}
+
+// Remembers the Lua strings created for recently seen object keys, so arrays
+// of records do not unescape, hash and intern the same keys for every element.
+// Keys are looked up by their raw bytes, which must stay valid for the whole
+// parse call. The cached strings are anchored in a table that the constructor
+// pushes onto the Lua stack; it has to stay below the values being built.
+class key_cache
+{
+public:
+  explicit key_cache(lua_State *L) : L(L)
+  {
+    lua_newtable(L);
+    table_index = lua_gettop(L);
+  }
+
+  // Pushes the string cached for raw and returns true, or returns false if
+  // raw has not been seen recently.
+  bool push(std::string_view raw)
+  {
+    last_slot = slot_for(raw);
+    const entry &cached = entries[last_slot];
+    if (cached.data == nullptr || cached.length != raw.size() ||
+        std::memcmp(cached.data, raw.data(), raw.size()) != 0)
+    {
+      return false;
+    }
+    lua_rawgeti(L, table_index, static_cast<int>(last_slot) + 1);
+    return true;
+  }
+
+  // Caches the string on top of the stack for the raw key that the previous
+  // push() call missed.
+  void remember(std::string_view raw)
+  {
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, table_index, static_cast<int>(last_slot) + 1);
+    entries[last_slot] = entry{raw.data(), raw.size()};
+  }
+
+private:
+  static constexpr size_t SLOT_COUNT = 256;
+
+  struct entry
+  {
+    const char *data;
+    size_t length;
+  };
+
+  // Keys in one document usually differ in length or in their first or last
+  // few bytes, so those are all that is hashed.
+  static size_t slot_for(std::string_view raw)
+  {
+    uint64_t head = 0;
+    uint64_t tail = 0;
+    size_t n = raw.size() < sizeof(head) ? raw.size() : sizeof(head);
+    std::memcpy(&head, raw.data(), n);
+    std::memcpy(&tail, raw.data() + raw.size() - n, n);
+    uint64_t hash = (head ^ (tail * 0x9E3779B97F4A7C15ULL) ^ raw.size()) *
+                    0xFF51AFD7ED558CCDULL;
+    return static_cast<size_t>(hash >> 56) & (SLOT_COUNT - 1);
+  }
+
+  lua_State *L;
+  int table_index;
+  size_t last_slot = 0;
+  entry entries[SLOT_COUNT] = {};
+};
+
+// One array or object that is still being converted. Its table sits on the
+// Lua stack, followed by the key of the field being converted for objects.
+struct ondemand_frame
+{
+  bool is_object;
+  int count;
+  ondemand::array_iterator array_position;
+  ondemand::array_iterator array_end;
+  ondemand::object_iterator object_position;
+  ondemand::object_iterator object_end;
+};
+
+// Reused between conversions and reserved up to the depth limit on first use,
+// so pushing a frame never reallocates while references to frames are held.
+thread_local std::vector<ondemand_frame> ondemand_frames;
+
+static ondemand_frame &push_ondemand_frame(lua_State *L,
+                                           std::vector<ondemand_frame> &frames,
+                                           bool is_object)
+{
+  if (frames.size() >= LUA_SIMDJSON_MAX_PARSE_DEPTH)
+  {
+    luaL_error(L, "maximum nesting depth exceeded (limit: %d)",
+               LUA_SIMDJSON_MAX_PARSE_DEPTH);
+  }
+  // Each level holds its table and a key. Stack space is reserved for a
+  // batch of levels at a time, with room for the value being converted and
+  // a copy made by key_cache, instead of calling into Lua for every table.
+  if (frames.size() % LUA_SIMDJSON_STACK_LEVELS_PER_CHECK == 0)
+  {
+    luaL_checkstack(L, 2 * LUA_SIMDJSON_STACK_LEVELS_PER_CHECK + 2,
+                    "JSON document is nested too deeply");
+  }
+  frames.emplace_back();
+  ondemand_frame &frame = frames.back();
+  frame.is_object = is_object;
+  frame.count = 1;
+  return frame;
+}
+
+// Pushes a string, number, boolean or null.
+template <typename T>
+static simdjson_inline void push_ondemand_scalar(lua_State *L, T &element,
+                                                 ondemand::json_type type)
+{
+  switch (type)
+  {
+  case ondemand::json_type::number:
+  {
+    ondemand::number number = element.get_number();
+    ondemand::number_type number_type = number.get_number_type();
+    switch (number_type)
+    {
+    case SIMDJSON_BUILTIN_IMPLEMENTATION::number_type::floating_point_number:
+      lua_pushnumber(L, element.get_double());
+      break;
+
+    case SIMDJSON_BUILTIN_IMPLEMENTATION::number_type::signed_integer:
+      lua_pushinteger(L, element.get_int64());
+      break;
+
+    case SIMDJSON_BUILTIN_IMPLEMENTATION::number_type::unsigned_integer:
+    {
+// a uint64 can be greater than an int64, so we must check how large and pass as a number
+// if larger but LUA_MAXINTEGER (which is only defined in 5.3+)
+#if defined(LUA_MAXINTEGER)
+      uint64_t actual_value = element.get_uint64();
+      if (actual_value > LUA_MAXINTEGER)
+      {
+        lua_pushnumber(L, actual_value);
+      }
+      else
+      {
+        lua_pushinteger(L, actual_value);
+      }
+#else
+      lua_pushnumber(L, element.get_double());
+#endif
+      break;
+    }
+
+    case SIMDJSON_BUILTIN_IMPLEMENTATION::number_type::big_integer:
+      lua_pushnumber(L, element.get_double());
+      break;
+    }
+    break;
+  }
+
+  case ondemand::json_type::string:
+  {
+    std::string_view s = element.get_string();
+    lua_pushlstring(L, s.data(), s.size());
+    break;
+  }
+
+  case ondemand::json_type::boolean:
+    lua_pushboolean(L, element.get_bool());
+    break;
+
+  case ondemand::json_type::null:
+    // calling is_null().value() will trigger an exception if the value is invalid
+    if (element.is_null().value())
+    {
+      lua_pushlightuserdata(L, NULL);
+    }
+    break;
+
+  case ondemand::json_type::unknown:
+  default:
+    luaL_error(L, "simdjson::ondemand::json_type::unknown or unsupported type encountered");
+    break;
+  }
+}
+
+// Pushes a scalar, or the empty table for an array or object together with a
+// frame for filling it. Returns true in the latter case.
+template <typename T>
+static simdjson_inline bool
+open_ondemand_element(lua_State *L, T &element, const parse_options &options,
+                      std::vector<ondemand_frame> &frames)
+{
+  static_assert(std::is_base_of<ondemand::document, T>::value || std::is_base_of<ondemand::document_reference, T>::value || std::is_base_of<ondemand::value, T>::value, "type parameter must be document, document_reference or value");
+
+  ondemand::json_type type = element.type();
+  switch (type)
+  {
+
+  case ondemand::json_type::array:
+  {
+    ondemand::array array = element.get_array();
+    int narr = 0;
+    if (options.presize)
+    {
+      // count_elements() scans ahead and rewinds, so the array can still be
+      // iterated afterwards.
+      narr = table_size_hint(array.count_elements());
+    }
+    ondemand_frame &frame = push_ondemand_frame(L, frames, false);
+    lua_createtable(L, narr, 0);
+    frame.array_position = array.begin();
+    frame.array_end = array.end();
+    return true;
+  }
+
+  case ondemand::json_type::object:
+  {
+    ondemand::object object = element.get_object();
+    int nrec = 0;
+    if (options.presize)
+    {
+      nrec = table_size_hint(object.count_fields());
+    }
+    ondemand_frame &frame = push_ondemand_frame(L, frames, true);
+    lua_createtable(L, 0, nrec);
+    frame.object_position = object.begin();
+    frame.object_end = object.end();
+    return true;
+  }
+
+  default:
+    push_ondemand_scalar(L, element, type);
+    return false;
+  }
+}
+
+// Stores the value on top of the stack in the innermost open container and
+// moves that container on to its next element. The iterators may only advance
+// once the value has been consumed completely.
+static void store_ondemand_value(lua_State *L,
+                                 std::vector<ondemand_frame> &frames)
+{
+  if (frames.empty())
+  {
+    return;
+  }
+  ondemand_frame &parent = frames.back();
+  if (parent.is_object)
+  {
+    lua_rawset(L, -3);
+    ++parent.object_position;
+  }
+  else
+  {
+    lua_rawseti(L, -2, parent.count);
+    parent.count = parent.count + 1;
+    ++parent.array_position;
+  }
+}
+
+// Converts element without recursion: nested containers are tracked in
+// ondemand_frames, so document depth costs neither C stack nor more than two
+// Lua stack slots per level, and is capped at LUA_SIMDJSON_MAX_PARSE_DEPTH.
+template <typename T>
+void convert_ondemand_element_to_table(lua_State *L, T &element,
+                                       const parse_options &options,
+                                       key_cache &keys)
+{
+  // Looked up once: every thread_local access costs a call in a shared
+  // library.
+  std::vector<ondemand_frame> &frames = ondemand_frames;
+  if (frames.capacity() < LUA_SIMDJSON_MAX_PARSE_DEPTH)
+  {
+    frames.reserve(LUA_SIMDJSON_MAX_PARSE_DEPTH);
+  }
+  // An earlier conversion may have been abandoned by an error.
+  frames.clear();
+
+  if (!open_ondemand_element(L, element, options, frames))
+  {
+    return;
+  }
+
+  while (!frames.empty())
+  {
+    ondemand_frame &frame = frames.back();
+    bool descended = false;
+    // The loops below work on local copies of the frame's iterators so that
+    // they stay in registers. They are written back only before descending
+    // into a child container; frames never reallocate, so frame stays valid.
+    if (frame.is_object)
+    {
+      ondemand::object_iterator position = frame.object_position;
+      ondemand::object_iterator end = frame.object_end;
+      for (; position != end; ++position)
+      {
+        ondemand::field field = *position;
+        // The escaped key points into the input buffer, so it can be used as
+        // the cache key without unescaping it first.
+        std::string_view raw = field.escaped_key();
+        if (!keys.push(raw))
+        {
+          std::string_view s = field.unescaped_key();
+          lua_pushlstring(L, s.data(), s.size());
+          keys.remember(raw);
+        }
+        if (open_ondemand_element(L, field.value(), options, frames))
+        {
+          frame.object_position = position;
+          descended = true;
+          break;
+        }
+        lua_rawset(L, -3);
+      }
+    }
+    else
+    {
+      ondemand::array_iterator position = frame.array_position;
+      ondemand::array_iterator end = frame.array_end;
+      int count = frame.count;
+      for (; position != end; ++position)
+      {
+        ondemand::value child = *position;
+        if (open_ondemand_element(L, child, options, frames))
+        {
+          frame.array_position = position;
+          frame.count = count;
+          descended = true;
+          break;
+        }
+        lua_rawseti(L, -2, count);
+        count = count + 1;
+      }
+    }
+
+    if (!descended)
+    {
+      frames.pop_back();
+      store_ondemand_value(L, frames);
+    }
+  }
+}
+
+// Reserves Lua stack space for the next batch of nesting levels, as
+// push_ondemand_frame does.
+static void check_dom_stack(lua_State *L, int depth)
+{
+  if (depth % LUA_SIMDJSON_STACK_LEVELS_PER_CHECK == 0)
+  {
+    luaL_checkstack(L, 2 * LUA_SIMDJSON_STACK_LEVELS_PER_CHECK + 2,
+                    "JSON document is nested too deeply");
+  }
+}
+
+// A container in which none of the requested paths exist is left out, except
+// for the root, which is always returned as a table.
+static bool keep_empty(lua_State *L, int depth)
+{
+  if (depth == 0)
+  {
+    return true;
+  }
+  lua_pop(L, 1);
+  return false;
+}
+
+// Converts the parts of element selected by node. Fields and elements that
+// are not selected are never converted: the on-demand iterators skip them
+// when they move on. Returns false, with nothing pushed, if none of the
+// requested paths exist below element. Recursion follows the projection,
+// which cannot usefully be deeper than the parser's depth limit.
+template <typename T>
+static bool convert_projected_element(lua_State *L, T &element,
+                                      const pointer_tree &node,
+                                      const parse_options &options,
+                                      key_cache &keys, int depth = 0)
+{
+  if (node.whole)
+  {
+    convert_ondemand_element_to_table(L, element, options, keys);
+    return true;
+  }
+
+  switch (element.type())
+  {
+  case ondemand::json_type::object:
+  {
+    check_dom_stack(L, depth);
+    ondemand::object object = element.get_object();
+    lua_newtable(L);
+    bool found = false;
+    for (ondemand::field field : object)
+    {
+      std::string_view raw = field.escaped_key();
+      std::string_view key = raw;
+      if (std::memchr(raw.data(), '\\', raw.size()) != nullptr)
+      {
+        key = field.unescaped_key();
+      }
+      const pointer_tree *child = node.find(key);
+      if (child == nullptr)
+      {
+        continue;
+      }
+      if (!keys.push(raw))
+      {
+        lua_pushlstring(L, key.data(), key.size());
+        keys.remember(raw);
+      }
+      ondemand::value value = field.value();
+      if (convert_projected_element(L, value, *child, options, keys, depth + 1))
+      {
+        lua_rawset(L, -3);
+        found = true;
+      }
+      else
+      {
+        lua_pop(L, 1);
+      }
+    }
+    return found || keep_empty(L, depth);
+  }
+
+  case ondemand::json_type::array:
+  {
+    check_dom_stack(L, depth);
+    ondemand::array array = element.get_array();
+    lua_newtable(L);
+    bool found = false;
+    size_t index = 0;
+    size_t next = 0;
+    for (ondemand::value value : array)
+    {
+      if (!node.any && next == node.elements.size())
+      {
+        break;
+      }
+      const pointer_tree *child = node.any.get();
+      if (next < node.elements.size() && node.elements[next].first == index)
+      {
+        child = node.elements[next].second;
+        next++;
+      }
+      if (child != nullptr &&
+          convert_projected_element(L, value, *child, options, keys, depth + 1))
+      {
+        lua_rawseti(L, -2, static_cast<lua_Integer>(index + 1));
+        found = true;
+      }
+      index++;
+    }
+    return found || keep_empty(L, depth);
+  }
+
+  default:
+    return false;
+  }
+}
+
+template <typename T>
+static void convert_ondemand_document(lua_State *L, T &doc,
+                                      const parse_options &options,
+                                      key_cache &keys)
+{
+  if (options.only == nullptr)
+  {
+    convert_ondemand_element_to_table(L, doc, options, keys);
+  }
+  else if (!convert_projected_element(L, doc, *options.only, options, keys))
+  {
+    lua_pushnil(L);
+  }
+}
+
+// The DOM parser has already rejected documents nested deeper than
+// LUA_SIMDJSON_MAX_PARSE_DEPTH, so the recursion here is bounded.
+static void convert_dom_element_to_table(lua_State *L, dom::element element,
+                                         key_cache &keys, int depth = 0)
+{
+  switch (element.type())
+  {
+
+  case dom::element_type::ARRAY:
+  {
+    check_dom_stack(L, depth);
+    dom::array array = element.get_array();
+    int count = 1;
+    lua_createtable(L, table_size_hint(array.size()), 0);
+
+    for (dom::element child : array)
+    {
+      convert_dom_element_to_table(L, child, keys, depth + 1);
+      lua_rawseti(L, -2, count);
+      count = count + 1;
+    }
+    break;
+  }
+
+  case dom::element_type::OBJECT:
+  {
+    check_dom_stack(L, depth);
+    dom::object object = element.get_object();
+    lua_createtable(L, 0, table_size_hint(object.size()));
+    for (dom::key_value_pair field : object)
+    {
+      // DOM keys live in the parser's string buffer until the next parse.
+      if (!keys.push(field.key))
+      {
+        lua_pushlstring(L, field.key.data(), field.key.size());
+        keys.remember(field.key);
+      }
+      convert_dom_element_to_table(L, field.value, keys, depth + 1);
+      lua_rawset(L, -3);
+    }
+    break;
+  }
+
+  case dom::element_type::DOUBLE:
+    lua_pushnumber(L, element.get_double());
+    break;
+
+  case dom::element_type::INT64:
+    lua_pushinteger(L, element.get_int64());
+    break;
+
+  case dom::element_type::UINT64:
+  {
+// see convert_ondemand_element_to_table for why large uint64 become numbers
+#if defined(LUA_MAXINTEGER)
+    uint64_t actual_value = element.get_uint64();
+    if (actual_value > LUA_MAXINTEGER)
+    {
+      lua_pushnumber(L, actual_value);
+    }
+    else
+    {
+      lua_pushinteger(L, actual_value);
+    }
+#else
+    lua_pushnumber(L, element.get_double());
+#endif
+    break;
+  }
+
+  case dom::element_type::STRING:
+  {
+    std::string_view s = element.get_string();
+    lua_pushlstring(L, s.data(), s.size());
+    break;
+  }
+
+  case dom::element_type::BOOL:
+    lua_pushboolean(L, element.get_bool());
+    break;
+
+  case dom::element_type::NULL_VALUE:
+    lua_pushlightuserdata(L, NULL);
+    break;
+
+  default:
+    luaL_error(L, "unsupported simdjson::dom::element_type encountered");
+    break;
+  }
+}
+
+static int parse(lua_State *L)
+{
+  size_t json_str_len;
+  const char *json_str = luaL_checklstring(L, 1, &json_str_len);
+  parse_options options;
+  read_parse_options(L, 2, options);
+
+  ondemand::document doc;
+
+  try
+  {
+    // Lua owns json_str and does not guarantee simdjson's required trailing
+    // padding. Unless the padding can be read in place, copy it into reusable
+    // padded storage before parsing.
+    simdjson::padded_string_view json =
+        can_parse_in_place(json_str, json_str_len)
+            ? in_place_view(json_str, json_str_len)
+            : copy_to_padded_buffer(L, json_str, json_str_len);
+    key_cache keys(L);
+    if (options.engine == parse_engine::dom)
+    {
+      // The buffer is already padded, so the DOM parser must not copy it.
+      convert_dom_element_to_table(
+          L, dom_parser.parse(json.data(), json.length(), false), keys);
+    }
+    else
+    {
+      doc = ondemand_parser.iterate(json);
+      convert_ondemand_document(L, doc, options, keys);
+    }
+  }
+  catch (simdjson::simdjson_error &error)
+  {
+    luaL_error(L, error.what());
+  }
+
+  return 1;
+}
+
+// Holds the file being converted by parseFile. It is released once the
+// conversion ends; if a Lua error escapes instead, the next call releases it.
+thread_local json_file_input parse_file_input;
+
+static int parse_file(lua_State *L)
+{
+  const char *json_file = luaL_checkstring(L, 1);
+  parse_options options;
+  read_parse_options(L, 2, options);
+
+  json_file_input &input = parse_file_input;
+  ondemand::document doc;
+
+  try
+  {
+    input.load(json_file);
+    simdjson::padded_string_view json = input.view();
+    key_cache keys(L);
+    if (options.engine == parse_engine::dom)
+    {
+      // The input is already padded, so the DOM parser must not copy it.
+      convert_dom_element_to_table(
+          L, dom_parser.parse(json.data(), json.length(), false), keys);
+    }
+    else
+    {
+      doc = ondemand_parser.iterate(json);
+      convert_ondemand_document(L, doc, options, keys);
+    }
+  }
+  catch (simdjson::simdjson_error &error)
+  {
+    input.release();
+    luaL_error(L, error.what());
+  }
+
+  input.release();
+  return 1;
+}
+
+// Reads every value below element, so that the on-demand parser reports the
+// first error in it. Only used to locate an error the DOM parser found, and
+// bounded by the parser's depth limit.
+template <typename T>
+static void consume_ondemand_element(T &element)
+{
+  error_code error = SUCCESS;
+  switch (element.type())
+  {
+  case ondemand::json_type::array:
+    for (ondemand::value child : element.get_array())
+    {
+      consume_ondemand_element(child);
+    }
+    break;
+
+  case ondemand::json_type::object:
+    for (ondemand::field field : element.get_object())
+    {
+      error = field.unescaped_key().error();
+      if (error)
+      {
+        break;
+      }
+      ondemand::value child = field.value();
+      consume_ondemand_element(child);
+    }
+    break;
+
+  case ondemand::json_type::number:
+    error = element.get_number().error();
+    break;
+
+  case ondemand::json_type::string:
+    error = element.get_string().error();
+    break;
+
+  case ondemand::json_type::boolean:
+    error = element.get_bool().error();
+    break;
+
+  case ondemand::json_type::null:
+    if (!element.is_null().value())
+    {
+      error = INCORRECT_TYPE;
+    }
+    break;
+
+  default:
+    error = INCORRECT_TYPE;
+    break;
+  }
+  if (error)
+  {
+    throw simdjson_error(error);
+  }
+}
+
+// Returns the offset of the first error in json, or -1 if it cannot be
+// told, e.g. for errors found while indexing the input.
+static long long locate_json_error(simdjson::padded_string_view json)
+{
+  ondemand::document doc;
+  try
+  {
+    doc = ondemand_parser.iterate(json);
+  }
+  catch (simdjson::simdjson_error &)
+  {
+    return -1;
+  }
+
+  try
+  {
+    consume_ondemand_element(doc);
+    if (doc.at_end())
+    {
+      return -1;
+    }
+  }
+  catch (simdjson::simdjson_error &)
+  {
+  }
+
+  const char *location = nullptr;
+  if (doc.current_location().get(location))
+  {
+    return -1;
+  }
+  return static_cast<long long>(location - json.data());
+}
+
+// Returns true if the string is valid JSON, or false, the error message and
+// the 1-based offset of the error (nil when unknown). No Lua values are
+// created for the document.
+static int validate(lua_State *L)
+{
+  size_t json_str_len;
+  const char *json_str = luaL_checklstring(L, 1, &json_str_len);
+
+  simdjson::padded_string_view json =
+      can_parse_in_place(json_str, json_str_len)
+          ? in_place_view(json_str, json_str_len)
+          : copy_to_padded_buffer(L, json_str, json_str_len);
+  // The DOM parser checks the whole document, including every scalar that
+  // the on-demand parser would only check when it is read.
+  error_code error = dom_parser.parse(json.data(), json.length(), false).error();
+  if (!error)
+  {
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+
+  lua_pushboolean(L, 0);
+  lua_pushstring(L, error_message(error));
+  long long offset = locate_json_error(json);
+  if (offset >= 0)
+  {
+    lua_pushinteger(L, static_cast<lua_Integer>(offset + 1));
+  }
+  else
+  {
+    lua_pushnil(L);
+  }
+  return 3;
+}
+
+thread_local std::unique_ptr<char[]> minify_buffer;
+thread_local size_t minify_buffer_capacity = 0;
+
+// Removes the whitespace between tokens with simdjson's SIMD minifier. Like
+// simdjson::minify, this does not validate the input; it only fails on
+// errors such as an unterminated string.
+static int minify(lua_State *L)
+{
+  size_t json_str_len;
+  const char *json_str = luaL_checklstring(L, 1, &json_str_len);
+  if (json_str_len > std::numeric_limits<size_t>::max() - SIMDJSON_PADDING)
+  {
+    return luaL_error(L, "JSON input is too large");
+  }
+
+  size_t required_capacity = json_str_len + SIMDJSON_PADDING;
+  if (minify_buffer_capacity < required_capacity)
+  {
+    char *replacement = new (std::nothrow) char[required_capacity];
+    if (replacement == nullptr)
+    {
+      return luaL_error(L, "failed to allocate JSON minify buffer");
+    }
+    minify_buffer.reset(replacement);
+    minify_buffer_capacity = required_capacity;
+  }
+
+  size_t minified_length = 0;
+  error_code error = simdjson::minify(json_str, json_str_len,
+                                      minify_buffer.get(), minified_length);
+  if (error)
+  {
+    return luaL_error(L, error_message(error));
+  }
+  lua_pushlstring(L, minify_buffer.get(), minified_length);
+  return 1;
+}
+
+// A JSON pointer split into reference tokens once, by compilePointer, so
+// that lookups with it skip parsing and unescaping the pointer.
+#define LUA_MYPOINTER "CompiledPointer"
+struct CompiledPointer
+{
+  std::string source;
+  std::vector<pointer_token> tokens;
+};
+
+// The CompiledPointer metatable is also stored in the registry under the
+// address of this variable. Looking it up by a light userdata key avoids
+// hashing the metatable name on every lookup.
+static const char compiled_pointer_metatable_key = 0;
+
+static CompiledPointer *to_compiled_pointer(lua_State *L, int index)
+{
+  void *userdata = lua_touserdata(L, index);
+  if (userdata == nullptr || !lua_getmetatable(L, index))
+  {
+    return nullptr;
+  }
+  lua_pushlightuserdata(L, const_cast<char *>(&compiled_pointer_metatable_key));
+  lua_rawget(L, LUA_REGISTRYINDEX);
+  bool is_pointer = lua_rawequal(L, -1, -2) != 0;
+  lua_pop(L, 2);
+  return is_pointer ? reinterpret_cast<CompiledPointer *>(userdata) : nullptr;
+}
+
+// Applies one token to a document or value, with the errors at_pointer
+// reports for the same step.
+template <typename T>
+static simdjson_result<ondemand::value>
+step_compiled_pointer(T &element, const pointer_token &token,
+                      error_code scalar_error)
+{
+  ondemand::json_type type;
+  error_code error = element.type().get(type);
+  if (error)
+  {
+    return error;
+  }
+  switch (type)
+  {
+  case ondemand::json_type::array:
+  {
+    if (token.index_error)
+    {
+      return token.index_error;
+    }
+    ondemand::array array;
+    error = element.get_array().get(array);
+    if (error)
+    {
+      return error;
+    }
+    return array.at(token.index);
+  }
+
+  case ondemand::json_type::object:
+  {
+    ondemand::object object;
+    error = element.get_object().get(object);
+    if (error)
+    {
+      return error;
+    }
+    return object.find_field(token.key);
+  }
+
+  default:
+    return scalar_error;
+  }
+}
+
+// Pushes the value the compiled pointer selects in document, which is
+// rewound first, as at_pointer does.
+static void push_compiled_pointer_value(lua_State *L,
+                                        ondemand::document &document,
+                                        const CompiledPointer &pointer,
+                                        key_cache &keys)
+{
+  if (pointer.tokens.empty())
+  {
+    ondemand::value root = document.at_pointer("");
+    convert_ondemand_element_to_table(L, root, parse_options(), keys);
+    return;
+  }
+  document.rewind();
+  ondemand::value value = step_compiled_pointer(document, pointer.tokens[0],
+                                                INVALID_JSON_POINTER);
+  for (size_t i = 1; i < pointer.tokens.size(); i++)
+  {
+    value = step_compiled_pointer(value, pointer.tokens[i], NO_SUCH_FIELD);
+  }
+  convert_ondemand_element_to_table(L, value, parse_options(), keys);
+}
+
+// Pushes the value at the pointer, compiled or given as a string, at
+// pointer_index.
+static void push_pointer_value(lua_State *L, ondemand::document &document,
+                               int pointer_index, key_cache &keys)
+{
+  CompiledPointer *compiled = to_compiled_pointer(L, pointer_index);
+  if (compiled != nullptr)
+  {
+    push_compiled_pointer_value(L, document, *compiled, keys);
+    return;
+  }
+  size_t length = 0;
+  const char *pointer = luaL_checklstring(L, pointer_index, &length);
+  ondemand::value value = document.at_pointer(std::string_view(pointer, length));
+  convert_ondemand_element_to_table(L, value, parse_options(), keys);
+}
+
+static int compile_pointer(lua_State *L)
+{
+  size_t length = 0;
+  const char *source = luaL_checklstring(L, 1, &length);
+
+  CompiledPointer *compiled = reinterpret_cast<CompiledPointer *>(
+      lua_newuserdata(L, sizeof(CompiledPointer)));
+  new (compiled) CompiledPointer();
+  luaL_getmetatable(L, LUA_MYPOINTER);
+  lua_setmetatable(L, -2);
+
+  compiled->source.assign(source, length);
+  if (!read_pointer(std::string_view(source, length), compiled->tokens))
+  {
+    luaL_argerror(L, 1, "invalid JSON pointer");
+  }
+  return 1;
+}
+
+static int CompiledPointer_tostring(lua_State *L)
+{
+  CompiledPointer *pointer =
+      reinterpret_cast<CompiledPointer *>(luaL_checkudata(L, 1, LUA_MYPOINTER));
+  lua_pushlstring(L, pointer->source.data(), pointer->source.size());
+  return 1;
+}
+
+static int CompiledPointer_delete(lua_State *L)
+{
+  reinterpret_cast<CompiledPointer *>(lua_touserdata(L, 1))->~CompiledPointer();
+  return 0;
+}
+
+// Parses the string and returns the values at each of the pointers that
+// follow it, without building tables for the rest of the document.
+static int extract(lua_State *L)
+{
+  size_t json_str_len;
+  const char *json_str = luaL_checklstring(L, 1, &json_str_len);
+  int pointer_count = lua_gettop(L) - 1;
+  luaL_argcheck(L, pointer_count >= 1, 2, "expected at least one JSON pointer");
+  luaL_checkstack(L, pointer_count + 2, "too many JSON pointers");
+
+  ondemand::document doc;
+
+  try
+  {
+    simdjson::padded_string_view json =
+        can_parse_in_place(json_str, json_str_len)
+            ? in_place_view(json_str, json_str_len)
+            : copy_to_padded_buffer(L, json_str, json_str_len);
+    doc = ondemand_parser.iterate(json);
+    for (int i = 0; i < pointer_count; i++)
+    {
+      key_cache keys(L);
+      push_pointer_value(L, doc, i + 2, keys);
+      lua_remove(L, -2);
+    }
+  }
+  catch (simdjson::simdjson_error &error)
+  {
+    luaL_error(L, error.what());
+  }
+
+  return pointer_count;
+}
+
+static int active_implementation(lua_State *L)
+{
+  const auto &implementation = simdjson::get_active_implementation();
+  std::string name = implementation->name();
+  const std::string description = implementation->description();
+  const std::string implementation_name = name + " (" + description + ")";
+
+  lua_pushlstring(L, implementation_name.data(), implementation_name.size());
+
+  return 1;
+}
+
+#define LUA_SIMDJSON_PARSER_POOL_SIZE_KEY "simdjson.parserPoolSize"
+#define LUA_SIMDJSON_PARSER_POOL_MAX_CAPACITY_KEY "simdjson.parserPoolMaxCapacity"
+#define DEFAULT_PARSER_POOL_SIZE 4
+#define MAX_PARSER_POOL_SIZE 1024
+#define DEFAULT_PARSER_POOL_MAX_CAPACITY (4 * 1024 * 1024)
+
+// Parsers handed back by closed or collected ParsedObjects. A parser keeps
+// its structural index between documents, so reusing one saves both the
+// allocation of the parser and the growth of its buffers on the first parse.
+thread_local std::vector<std::unique_ptr<ondemand::parser>> parser_pool;
+
+static lua_Integer check_integer_setting(lua_State *L, int index,
+                                         const char *name, lua_Integer minimum,
+                                         lua_Integer maximum)
+{
+  if (lua_type(L, index) != LUA_TNUMBER)
+  {
+    luaL_error(L, "%s must be an integer", name);
+  }
+
+  lua_Number number = lua_tonumber(L, index);
+  if (!std::isfinite(number) || std::floor(number) != number ||
+      number < static_cast<lua_Number>(minimum) ||
+      number > static_cast<lua_Number>(maximum))
+  {
+    luaL_error(L, "%s must be an integer between %lld and %lld", name,
+               static_cast<long long>(minimum),
+               static_cast<long long>(maximum));
+  }
+  return static_cast<lua_Integer>(number);
+}
+
+static size_t read_size_setting(lua_State *L, const char *key,
+                                size_t default_value, size_t maximum)
+{
+  lua_pushstring(L, key);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+  size_t setting = default_value;
+  if (lua_type(L, -1) == LUA_TNUMBER)
+  {
+    lua_Number value = lua_tonumber(L, -1);
+    if (std::isfinite(value) && std::floor(value) == value && value >= 0 &&
+        value <= static_cast<lua_Number>(maximum))
+    {
+      setting = static_cast<size_t>(value);
+    }
+  }
+  lua_pop(L, 1);
+  return setting;
+}
+
+static void write_size_setting(lua_State *L, const char *key, size_t value)
+{
+  lua_pushstring(L, key);
+  lua_pushinteger(L, static_cast<lua_Integer>(value));
+  lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+static size_t read_parser_pool_size(lua_State *L)
+{
+  return read_size_setting(L, LUA_SIMDJSON_PARSER_POOL_SIZE_KEY,
+                           DEFAULT_PARSER_POOL_SIZE, MAX_PARSER_POOL_SIZE);
+}
+
+static size_t read_parser_pool_max_capacity(lua_State *L)
+{
+  return read_size_setting(L, LUA_SIMDJSON_PARSER_POOL_MAX_CAPACITY_KEY,
+                           DEFAULT_PARSER_POOL_MAX_CAPACITY,
+                           SIMDJSON_MAXSIZE_BYTES);
+}
+
+static std::unique_ptr<ondemand::parser> checkout_parser()
+{
+  std::vector<std::unique_ptr<ondemand::parser>> &pool = parser_pool;
+  if (pool.empty())
+  {
+    return std::unique_ptr<ondemand::parser>(new ondemand::parser{});
+  }
+  std::unique_ptr<ondemand::parser> parser = std::move(pool.back());
+  pool.pop_back();
+  return parser;
+}
+
+// Keeps the parser for the next open() unless the pool is full or the parser
+// grew beyond the capacity cap, so one huge document does not pin its
+// buffers for the lifetime of the thread.
+static void return_parser(lua_State *L, std::unique_ptr<ondemand::parser> parser)
+{
+  if (!parser)
+  {
+    return;
+  }
+  std::vector<std::unique_ptr<ondemand::parser>> &pool = parser_pool;
+  if (pool.size() < read_parser_pool_size(L) &&
+      parser->capacity() <= read_parser_pool_max_capacity(L))
+  {
+    pool.push_back(std::move(parser));
+  }
+}
+
+// ParsedObject as C++ class
+#define LUA_MYOBJECT "ParsedObject"
+class ParsedObject
+{
+private:
+  simdjson::padded_string json_string;
+  json_file_input json_file;
+  ondemand::document doc;
+  std::unique_ptr<ondemand::parser> parser;
+  // The input being iterated, wherever it is stored.
+  simdjson::padded_string_view input;
+  // Registry reference pinning the Lua string that is parsed in place, or
+  // LUA_NOREF when the input was copied into json_string.
+  int source_ref = LUA_NOREF;
+  // DOM tape built from the input by the first query(), or null.
+  std::unique_ptr<dom::document> query_tape;
+
+public:
+  ParsedObject(const char *json_file, std::unique_ptr<ondemand::parser> parser)
+      : parser(std::move(parser))
+  {
+    this->json_file.load(json_file);
+    this->input = this->json_file.view();
+    this->doc = this->parser.get()->iterate(this->input);
+  }
+  ParsedObject(const char *json_str, size_t json_str_len,
+               std::unique_ptr<ondemand::parser> parser)
+      : json_string(json_str, json_str_len),
+        parser(std::move(parser))
+  {
+    this->input = simdjson::padded_string_view(this->json_string);
+    this->doc = this->parser.get()->iterate(this->input);
+  }
+  // Parses memory owned by a Lua string, which the caller must pin with
+  // set_source_ref() for as long as this object lives.
+  ParsedObject(simdjson::padded_string_view json,
+               std::unique_ptr<ondemand::parser> parser)
+      : parser(std::move(parser)), input(json)
+  {
+    this->doc = this->parser.get()->iterate(json);
+  }
+  ~ParsedObject() {}
+  // Returns nullptr once the object has been closed.
+  ondemand::document *get_doc()
+  {
+    return this->parser ? &(this->doc) : nullptr;
+  }
+  simdjson::padded_string_view get_input() { return this->input; }
+  dom::document *get_query_tape() { return this->query_tape.get(); }
+  void set_query_tape(std::unique_ptr<dom::document> tape)
+  {
+    this->query_tape = std::move(tape);
+  }
+  int get_source_ref() { return this->source_ref; }
+  void set_source_ref(int ref) { this->source_ref = ref; }
+  // Drops the document and its input and gives up the parser.
+  std::unique_ptr<ondemand::parser> close()
+  {
+    this->doc = ondemand::document();
+    this->input = simdjson::padded_string_view();
+    this->json_string = padded_string();
+    this->json_file.release();
+    this->query_tape.reset();
+    return std::move(this->parser);
+  }
+};
+
+static ondemand::document *check_document(lua_State *L, ParsedObject *object)
+{
+  ondemand::document *document = object->get_doc();
+  if (document == nullptr)
+  {
+    luaL_error(L, "attempt to use a closed document");
+  }
+  return document;
+}
+
+static ParsedObject *check_parsed_object(lua_State *L, int index)
+{
+  return *reinterpret_cast<ParsedObject **>(
+      luaL_checkudata(L, index, LUA_MYOBJECT));
+}
+
+static void close_parsed_object(lua_State *L, ParsedObject *object)
+{
+  return_parser(L, object->close());
+  luaL_unref(L, LUA_REGISTRYINDEX, object->get_source_ref());
+  object->set_source_ref(LUA_NOREF);
+}
+
+static int ParsedObject_delete(lua_State *L)
+{
+  ParsedObject *object = *reinterpret_cast<ParsedObject **>(lua_touserdata(L, 1));
+  close_parsed_object(L, object);
+  delete object;
+  return 0;
+}
+
+// Releases the document's memory and returns its parser to the pool without
+// waiting for the garbage collector. Values already taken from the document
+// stay valid; any further lookup raises an error.
+static int ParsedObject_close(lua_State *L)
+{
+  close_parsed_object(L, check_parsed_object(L, 1));
+  return 0;
+}
+
+static int ParsedObject_open(lua_State *L)
+{
+  size_t json_str_len;
+  const char *json_str = luaL_checklstring(L, 1, &json_str_len);
+
+  try
+  {
+    ParsedObject **parsedObject =
+        (ParsedObject **)(lua_newuserdata(L, sizeof(ParsedObject *)));
+    if (can_parse_in_place(json_str, json_str_len))
+    {
+      *parsedObject = new ParsedObject(in_place_view(json_str, json_str_len),
+                                       checkout_parser());
+      lua_pushvalue(L, 1);
+      (*parsedObject)->set_source_ref(luaL_ref(L, LUA_REGISTRYINDEX));
+    }
+    else
+    {
+      *parsedObject =
+          new ParsedObject(json_str, json_str_len, checkout_parser());
+    }
+    luaL_getmetatable(L, LUA_MYOBJECT);
+    lua_setmetatable(L, -2);
+  }
+  catch (simdjson::simdjson_error &error)
+  {
+    luaL_error(L, error.what());
+  }
+  return 1;
+}
+
+static int ParsedObject_open_file(lua_State *L)
+{
+  const char *json_file = luaL_checkstring(L, 1);
+
+  try
+  {
+    ParsedObject **parsedObject =
+        (ParsedObject **)(lua_newuserdata(L, sizeof(ParsedObject *)));
+    *parsedObject = new ParsedObject(json_file, checkout_parser());
+    luaL_getmetatable(L, LUA_MYOBJECT);
+    lua_setmetatable(L, -2);
+  }
+  catch (simdjson::simdjson_error &error)
+  {
+    luaL_error(L, error.what());
+  }
+
+  return 1;
+}
+
+static int ParsedObject_atPointer(lua_State *L)
+{
+  ondemand::document *document = check_document(L, check_parsed_object(L, 1));
+  if (to_compiled_pointer(L, 2) == nullptr)
+  {
+    luaL_checkstring(L, 2);
+  }
+
+  try
+  {
+    key_cache keys(L);
+    push_pointer_value(L, *document, 2, keys);
+  }
+  catch (simdjson::simdjson_error &error)
+  {
+    luaL_error(L, error.what());
+  }
+
+  return 1;
+}
+
+// The pointers passed to atPointers. Reused between calls, so the tree is
+// never leaked when an error unwinds past it.
+thread_local pointer_tree pointer_batch;
+
+// Adds the path of a pointer to the tree.
+static void add_batch_pointer(pointer_tree &root,
+                              const std::vector<pointer_token> &tokens,
+                              int slot)
+{
+  pointer_tree *node = &root;
+  for (const pointer_token &token : tokens)
+  {
+    node = &node->child(token);
+  }
+  node->slots.push_back(slot);
+}
+
+// Converts element in full, like convert_ondemand_element_to_table, while
+// resolving the pointers below node. Each container on the way to them is
+// built one level at a time so that they come from the same walk, and
+// resolve to the first of repeated object keys, as at_pointer does, rather
+// than to the last one, which is the one the table keeps. Recursion follows
+// the pointers, like convert_projected_element.
+template <typename T>
+static void convert_batch_element(lua_State *L, T &element,
+                                  pointer_tree &node, int results,
+                                  key_cache &keys, int depth)
+{
+  ondemand::json_type type = element.type();
+  if (node.children.empty() || (type != ondemand::json_type::object &&
+                                type != ondemand::json_type::array))
+  {
+    convert_ondemand_element_to_table(L, element, parse_options(), keys);
+  }
+  else if (type == ondemand::json_type::object)
+  {
+    check_dom_stack(L, depth);
+    ondemand::object object = element.get_object();
+    lua_newtable(L);
+    for (ondemand::field field : object)
+    {
+      std::string_view raw = field.escaped_key();
+      std::string_view key = raw;
+      if (std::memchr(raw.data(), '\\', raw.size()) != nullptr)
+      {
+        key = field.unescaped_key();
+      }
+      if (!keys.push(raw))
+      {
+        lua_pushlstring(L, key.data(), key.size());
+        keys.remember(raw);
+      }
+      ondemand::value value = field.value();
+      auto child = node.children.find(key);
+      if (child != node.children.end() && !child->second->visited)
+      {
+        child->second->visited = true;
+        convert_batch_element(L, value, *child->second, results, keys,
+                              depth + 1);
+      }
+      else
+      {
+        convert_ondemand_element_to_table(L, value, parse_options(), keys);
+      }
+      lua_rawset(L, -3);
+    }
+  }
+  else
+  {
+    check_dom_stack(L, depth);
+    ondemand::array array = element.get_array();
+    lua_newtable(L);
+    size_t index = 0;
+    size_t next = 0;
+    for (ondemand::value value : array)
+    {
+      if (next < node.elements.size() && node.elements[next].first == index)
+      {
+        convert_batch_element(L, value, *node.elements[next].second, results,
+                              keys, depth + 1);
+        next++;
+      }
+      else
+      {
+        convert_ondemand_element_to_table(L, value, parse_options(), keys);
+      }
+      lua_rawseti(L, -2, static_cast<int>(index + 1));
+      index++;
+    }
+  }
+
+  for (int slot : node.slots)
+  {
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, results, slot);
+  }
+}
+
+// Walks the document once, converting the value at each path in the tree
+// and storing it in the results table under the slots of its pointers.
+// Paths that are not found are left for the caller.
+template <typename T>
+static void fetch_batch_from_element(lua_State *L, T &element,
+                                     pointer_tree &node, int results,
+                                     key_cache &keys)
+{
+  if (!node.slots.empty())
+  {
+    convert_batch_element(L, element, node, results, keys, 0);
+    lua_pop(L, 1);
+    return;
+  }
+
+  size_t remaining = node.children.size();
+  switch (element.type())
+  {
+  case ondemand::json_type::object:
+  {
+    ondemand::object object = element.get_object();
+    for (ondemand::field field : object)
+    {
+      std::string_view key = field.escaped_key();
+      if (std::memchr(key.data(), '\\', key.size()) != nullptr)
+      {
+        key = field.unescaped_key();
+      }
+      auto child = node.children.find(key);
+      if (child == node.children.end() || child->second->visited)
+      {
+        continue;
+      }
+      child->second->visited = true;
+      ondemand::value value = field.value();
+      fetch_batch_from_element(L, value, *child->second, results, keys);
+      if (--remaining == 0)
+      {
+        break;
+      }
+    }
+    break;
+  }
+
+  case ondemand::json_type::array:
+  {
+    ondemand::array array = element.get_array();
+    size_t index = 0;
+    size_t next = 0;
+    for (ondemand::value value : array)
+    {
+      if (next == node.elements.size())
+      {
+        break;
+      }
+      if (node.elements[next].first == index)
+      {
+        fetch_batch_from_element(L, value, *node.elements[next].second,
+                                 results, keys);
+        next++;
+      }
+      index++;
+    }
+    break;
+  }
+
+  default:
+    break;
+  }
+}
+
+// Looks up several JSON pointers and returns their values in order. The
+// pointers are merged into a tree and resolved in a single pass over the
+// document, instead of rewinding and scanning it again for every pointer.
+static int ParsedObject_atPointers(lua_State *L)
+{
+  ondemand::document *document = check_document(L, check_parsed_object(L, 1));
+  luaL_checktype(L, 2, LUA_TTABLE);
+
+  int count = 0;
+  pointer_tree &root = pointer_batch;
+  root.clear();
+  for (;; count++)
+  {
+    lua_rawgeti(L, 2, count + 1);
+    if (lua_isnil(L, -1))
+    {
+      lua_pop(L, 1);
+      break;
+    }
+    // Compiled pointers are added as they are, without going back through
+    // their source.
+    CompiledPointer *compiled = to_compiled_pointer(L, -1);
+    if (compiled != nullptr)
+    {
+      add_batch_pointer(root, compiled->tokens, count + 1);
+    }
+    else if (lua_type(L, -1) == LUA_TSTRING)
+    {
+      size_t length = 0;
+      const char *source = lua_tolstring(L, -1, &length);
+      std::vector<pointer_token> &tokens = pointer_tokens;
+      // Invalid pointers are left out of the tree, so their slot stays
+      // empty and the lookup below raises at_pointer's error for them.
+      if (read_pointer(std::string_view(source, length), tokens))
+      {
+        add_batch_pointer(root, tokens, count + 1);
+      }
+    }
+    else
+    {
+      luaL_error(L, "atPointers expects a table of JSON pointers");
+    }
+    lua_pop(L, 1);
+  }
+  luaL_checkstack(L, count + 3, "too many JSON pointers");
+
+  lua_createtable(L, count, 0);
+  int results = lua_gettop(L);
+
+  try
+  {
+    key_cache keys(L);
+    document->rewind();
+    fetch_batch_from_element(L, *document, root, results, keys);
+    lua_pop(L, 1);
+
+    // Anything the single pass did not find is looked up on its own, which
+    // raises the same error as atPointer would.
+    for (int i = 1; i <= count; i++)
+    {
+      lua_rawgeti(L, results, i);
+      bool found = !lua_isnil(L, -1);
+      lua_pop(L, 1);
+      if (!found)
+      {
+        lua_rawgeti(L, 2, i);
+        int pointer_index = lua_gettop(L);
+        key_cache missing_keys(L);
+        push_pointer_value(L, *document, pointer_index, missing_keys);
+        lua_rawseti(L, results, i);
+        lua_pop(L, 2);
+      }
+    }
+  }
+  catch (simdjson::simdjson_error &error)
+  {
+    luaL_error(L, error.what());
+  }
+
+  for (int i = 1; i <= count; i++)
+  {
+    lua_rawgeti(L, results, i);
+  }
+  return count;
+}
+
+// A compiled JSONPath expression. Supported are child names (.name and
+// ['name']), wildcards (* and [*]), recursive descent (..), index lists
+// ([0, -1]), slices ([start:end:step] with a positive step) and filters
+// ([?(@.price > 10 && @.id)]) that compare a relative path with a literal.
+struct jsonpath_literal
+{
+  dom::element_type type = dom::element_type::NULL_VALUE;
+  double number = 0;
+  std::string string;
+  bool boolean = false;
+};
+
+enum class jsonpath_comparison
+{
+  exists,
+  equal,
+  not_equal,
+  less,
+  less_equal,
+  greater,
+  greater_equal
+};
+
+struct jsonpath_condition
+{
+  // Keys and indexes below @, as written.
+  std::vector<pointer_token> path;
+  jsonpath_comparison comparison = jsonpath_comparison::exists;
+  jsonpath_literal literal;
+};
+
+enum class jsonpath_selector
+{
+  names,
+  wildcard,
+  indexes,
+  slice,
+  filter
+};
+
+struct jsonpath_segment
+{
+  jsonpath_selector selector = jsonpath_selector::wildcard;
+  // Applies the selector to the value and to all of its descendants.
+  bool recursive = false;
+  std::vector<std::string> names;
+  std::vector<long long> indexes;
+  bool has_start = false;
+  bool has_end = false;
+  long long start = 0;
+  long long end = 0;
+  long long step = 1;
+  // Alternatives joined by ||, each made of conditions joined by &&.
+  std::vector<std::vector<jsonpath_condition>> filter;
+};
+
+// Reused between calls, so the expression is never leaked when an error
+// unwinds past it.
+thread_local std::vector<jsonpath_segment> jsonpath_query;
+
+class jsonpath_compiler
+{
+public:
+  jsonpath_compiler(lua_State *L, std::string_view path)
+      : L(L), path(path) {}
+
+  void compile(std::vector<jsonpath_segment> &segments)
+  {
+    segments.clear();
+    skip_space();
+    expect('$');
+    while (skip_space(), position < path.size())
+    {
+      segments.emplace_back();
+      jsonpath_segment &segment = segments.back();
+      if (consume(".."))
+      {
+        segment.recursive = true;
+        if (peek() == '[')
+        {
+          read_bracket(segment);
+        }
+        else
+        {
+          read_dot_selector(segment);
+        }
+      }
+      else if (consume("."))
+      {
+        read_dot_selector(segment);
+      }
+      else if (peek() == '[')
+      {
+        read_bracket(segment);
+      }
+      else
+      {
+        fail();
+      }
+    }
+  }
+
+private:
+  lua_State *L;
+  std::string_view path;
+  size_t position = 0;
+
+  void fail()
+  {
+    luaL_error(L, "invalid JSONPath at position %d",
+               static_cast<int>(position + 1));
+  }
+
+  char peek() const { return position < path.size() ? path[position] : '\0'; }
+
+  void skip_space()
+  {
+    while (position < path.size() &&
+           (path[position] == ' ' || path[position] == '\t'))
+    {
+      position++;
+    }
+  }
+
+  bool consume(const char *token)
+  {
+    size_t length = std::strlen(token);
+    if (path.substr(position, length) == token)
+    {
+      position += length;
+      return true;
+    }
+    return false;
+  }
+
+  void expect(char c)
+  {
+    if (peek() != c)
+    {
+      fail();
+    }
+    position++;
+  }
+
+  static bool is_name_char(char c)
+  {
+    return c != '.' && c != '[' && c != ']' && c != ' ' && c != '\t' &&
+           c != '(' && c != ')' && c != '=' && c != '!' && c != '<' &&
+           c != '>' && c != '&' && c != '|' && c != ',' && c != '\0';
+  }
+
+  std::string read_name()
+  {
+    size_t begin = position;
+    while (is_name_char(peek()))
+    {
+      position++;
+    }
+    if (position == begin)
+    {
+      fail();
+    }
+    return std::string(path.substr(begin, position - begin));
+  }
+
+  void read_dot_selector(jsonpath_segment &segment)
+  {
+    if (consume("*"))
+    {
+      segment.selector = jsonpath_selector::wildcard;
+      return;
+    }
+    segment.selector = jsonpath_selector::names;
+    segment.names.push_back(read_name());
+  }
+
+  std::string read_quoted()
+  {
+    char quote = peek();
+    position++;
+    std::string value;
+    while (position < path.size() && path[position] != quote)
+    {
+      if (path[position] == '\\' && position + 1 < path.size())
+      {
+        position++;
+      }
+      value += path[position];
+      position++;
+    }
+    expect(quote);
+    return value;
+  }
+
+  bool read_integer(long long &value)
+  {
+    size_t begin = position;
+    bool negative = consume("-");
+    if (!std::isdigit(static_cast<unsigned char>(peek())))
+    {
+      position = begin;
+      return false;
+    }
+    value = 0;
+    while (std::isdigit(static_cast<unsigned char>(peek())))
+    {
+      if (value > (std::numeric_limits<long long>::max() - 9) / 10)
+      {
+        fail();
+      }
+      value = value * 10 + (path[position] - '0');
+      position++;
+    }
+    value = negative ? -value : value;
+    return true;
+  }
+
+  void read_bracket(jsonpath_segment &segment)
+  {
+    expect('[');
+    skip_space();
+    if (consume("*"))
+    {
+      segment.selector = jsonpath_selector::wildcard;
+    }
+    else if (consume("?("))
+    {
+      segment.selector = jsonpath_selector::filter;
+      read_filter(segment);
+      skip_space();
+      expect(')');
+    }
+    else if (peek() == '\'' || peek() == '"')
+    {
+      segment.selector = jsonpath_selector::names;
+      do
+      {
+        skip_space();
+        if (peek() != '\'' && peek() != '"')
+        {
+          fail();
+        }
+        segment.names.push_back(read_quoted());
+        skip_space();
+      } while (consume(","));
+    }
+    else
+    {
+      read_indexes_or_slice(segment);
+    }
+    skip_space();
+    expect(']');
+  }
+
+  void read_indexes_or_slice(jsonpath_segment &segment)
+  {
+    long long value = 0;
+    bool has_first = read_integer(value);
+    skip_space();
+    if (peek() != ':')
+    {
+      if (!has_first)
+      {
+        fail();
+      }
+      segment.selector = jsonpath_selector::indexes;
+      segment.indexes.push_back(value);
+      while (skip_space(), consume(","))
+      {
+        skip_space();
+        if (!read_integer(value))
+        {
+          fail();
+        }
+        segment.indexes.push_back(value);
+      }
+      return;
+    }
+
+    segment.selector = jsonpath_selector::slice;
+    segment.has_start = has_first;
+    segment.start = value;
+    position++;
+    skip_space();
+    segment.has_end = read_integer(segment.end);
+    skip_space();
+    if (consume(":"))
+    {
+      skip_space();
+      if (read_integer(segment.step) && segment.step <= 0)
+      {
+        luaL_error(L, "JSONPath slice step must be positive");
+      }
+    }
+  }
+
+  void read_filter(jsonpath_segment &segment)
+  {
+    do
+    {
+      segment.filter.emplace_back();
+      do
+      {
+        segment.filter.back().emplace_back();
+        read_condition(segment.filter.back().back());
+      } while (skip_space(), consume("&&"));
+    } while (consume("||"));
+  }
+
+  static void add_condition_token(jsonpath_condition &condition,
+                                  std::string key)
+  {
+    condition.path.emplace_back();
+    condition.path.back().key = std::move(key);
+    parse_pointer_index(condition.path.back());
+  }
+
+  void read_condition(jsonpath_condition &condition)
+  {
+    skip_space();
+    expect('@');
+    while (true)
+    {
+      if (consume("."))
+      {
+        add_condition_token(condition, read_name());
+      }
+      else if (peek() == '[')
+      {
+        position++;
+        skip_space();
+        long long index = 0;
+        if (peek() == '\'' || peek() == '"')
+        {
+          add_condition_token(condition, read_quoted());
+        }
+        else if (read_integer(index) && index >= 0)
+        {
+          add_condition_token(condition, std::to_string(index));
+        }
+        else
+        {
+          fail();
+        }
+        skip_space();
+        expect(']');
+      }
+      else
+      {
+        break;
+      }
+    }
+
+    skip_space();
+    if (consume("=="))
+    {
+      condition.comparison = jsonpath_comparison::equal;
+    }
+    else if (consume("!="))
+    {
+      condition.comparison = jsonpath_comparison::not_equal;
+    }
+    else if (consume("<="))
+    {
+      condition.comparison = jsonpath_comparison::less_equal;
+    }
+    else if (consume(">="))
+    {
+      condition.comparison = jsonpath_comparison::greater_equal;
+    }
+    else if (consume("<"))
+    {
+      condition.comparison = jsonpath_comparison::less;
+    }
+    else if (consume(">"))
+    {
+      condition.comparison = jsonpath_comparison::greater;
+    }
+    else
+    {
+      return;
+    }
+    skip_space();
+    read_literal(condition.literal);
+  }
+
+  void read_literal(jsonpath_literal &literal)
+  {
+    if (peek() == '\'' || peek() == '"')
+    {
+      literal.type = dom::element_type::STRING;
+      literal.string = read_quoted();
+    }
+    else if (consume("true"))
+    {
+      literal.type = dom::element_type::BOOL;
+      literal.boolean = true;
+    }
+    else if (consume("false"))
+    {
+      literal.type = dom::element_type::BOOL;
+      literal.boolean = false;
+    }
+    else if (consume("null"))
+    {
+      literal.type = dom::element_type::NULL_VALUE;
+    }
+    else
+    {
+      const char *begin = path.data() + position;
+      char *end = nullptr;
+      std::string number(begin, path.size() - position);
+      literal.number = std::strtod(number.c_str(), &end);
+      if (end == number.c_str())
+      {
+        fail();
+      }
+      literal.type = dom::element_type::DOUBLE;
+      position += static_cast<size_t>(end - number.c_str());
+    }
+  }
+};
+
+static bool is_number_type(dom::element_type type)
+{
+  return type == dom::element_type::INT64 ||
+         type == dom::element_type::UINT64 ||
+         type == dom::element_type::DOUBLE;
+}
+
+static bool jsonpath_condition_holds(dom::element element,
+                                     const jsonpath_condition &condition)
+{
+  for (const pointer_token &token : condition.path)
+  {
+    dom::element child;
+    if (element.is_object())
+    {
+      if (element.get_object().at_key(token.key).get(child))
+      {
+        return false;
+      }
+    }
+    else if (element.is_array() && token.index_error == SUCCESS)
+    {
+      if (element.get_array().at(token.index).get(child))
+      {
+        return false;
+      }
+    }
+    else
+    {
+      return false;
+    }
+    element = child;
+  }
+
+  if (condition.comparison == jsonpath_comparison::exists)
+  {
+    return true;
+  }
+
+  dom::element_type type = element.type();
+  const jsonpath_literal &literal = condition.literal;
+  int order = 0;
+  if (is_number_type(type) && literal.type == dom::element_type::DOUBLE)
+  {
+    double value = element.get_double();
+    order = value < literal.number ? -1 : (value > literal.number ? 1 : 0);
+    if (std::isnan(value) || std::isnan(literal.number))
+    {
+      return condition.comparison == jsonpath_comparison::not_equal;
+    }
+  }
+  else if (type == dom::element_type::STRING &&
+           literal.type == dom::element_type::STRING)
+  {
+    int compared = std::string_view(element.get_string()).compare(literal.string);
+    order = compared < 0 ? -1 : (compared > 0 ? 1 : 0);
+  }
+  else if (type == dom::element_type::BOOL &&
+           literal.type == dom::element_type::BOOL)
+  {
+    if (element.get_bool() != literal.boolean)
+    {
+      return condition.comparison == jsonpath_comparison::not_equal;
+    }
+    return condition.comparison == jsonpath_comparison::equal;
+  }
+  else if (type == dom::element_type::NULL_VALUE &&
+           literal.type == dom::element_type::NULL_VALUE)
+  {
+    return condition.comparison == jsonpath_comparison::equal;
+  }
+  else
+  {
+    // Values of different types are only ever unequal.
+    return condition.comparison == jsonpath_comparison::not_equal;
+  }
+
+  switch (condition.comparison)
+  {
+  case jsonpath_comparison::equal:
+    return order == 0;
+  case jsonpath_comparison::not_equal:
+    return order != 0;
+  case jsonpath_comparison::less:
+    return order < 0;
+  case jsonpath_comparison::less_equal:
+    return order <= 0;
+  case jsonpath_comparison::greater:
+    return order > 0;
+  case jsonpath_comparison::greater_equal:
+    return order >= 0;
+  default:
+    return true;
+  }
+}
+
+static bool jsonpath_filter_matches(dom::element element,
+                                    const jsonpath_segment &segment)
+{
+  for (const std::vector<jsonpath_condition> &alternative : segment.filter)
+  {
+    bool holds = true;
+    for (const jsonpath_condition &condition : alternative)
+    {
+      if (!jsonpath_condition_holds(element, condition))
+      {
+        holds = false;
+        break;
+      }
+    }
+    if (holds)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Appends every match to the results table on the Lua stack, converting each
+// matched value only once it has been selected.
+class jsonpath_evaluator
+{
+public:
+  jsonpath_evaluator(lua_State *L, const std::vector<jsonpath_segment> &segments,
+                     int results, key_cache &keys)
+      : L(L), segments(segments), results(results), keys(keys) {}
+
+  void evaluate(dom::element element, size_t index)
+  {
+    if (index == segments.size())
+    {
+      convert_dom_element_to_table(L, element, keys);
+      lua_rawseti(L, results, ++count);
+      return;
+    }
+    const jsonpath_segment &segment = segments[index];
+    select(element, segment, index + 1);
+    if (segment.recursive)
+    {
+      descend(element, index);
+    }
+  }
+
+private:
+  lua_State *L;
+  const std::vector<jsonpath_segment> &segments;
+  int results;
+  key_cache &keys;
+  int count = 0;
+
+  // Applies a recursive segment to every descendant of element.
+  void descend(dom::element element, size_t index)
+  {
+    if (element.is_object())
+    {
+      for (dom::key_value_pair field : element.get_object())
+      {
+        evaluate(field.value, index);
+      }
+    }
+    else if (element.is_array())
+    {
+      for (dom::element child : element.get_array())
+      {
+        evaluate(child, index);
+      }
+    }
+  }
+
+  void select(dom::element element, const jsonpath_segment &segment,
+              size_t next)
+  {
+    switch (segment.selector)
+    {
+    case jsonpath_selector::names:
+      if (element.is_object())
+      {
+        dom::object object = element.get_object();
+        for (const std::string &name : segment.names)
+        {
+          dom::element child;
+          if (!object.at_key(name).get(child))
+          {
+            evaluate(child, next);
+          }
+        }
+      }
+      break;
+
+    case jsonpath_selector::wildcard:
+    case jsonpath_selector::filter:
+    {
+      bool filtered = segment.selector == jsonpath_selector::filter;
+      if (element.is_object())
+      {
+        for (dom::key_value_pair field : element.get_object())
+        {
+          if (!filtered || jsonpath_filter_matches(field.value, segment))
+          {
+            evaluate(field.value, next);
+          }
+        }
+      }
+      else if (element.is_array())
+      {
+        for (dom::element child : element.get_array())
+        {
+          if (!filtered || jsonpath_filter_matches(child, segment))
+          {
+            evaluate(child, next);
+          }
+        }
+      }
+      break;
+    }
+
+    case jsonpath_selector::indexes:
+      if (element.is_array())
+      {
+        dom::array array = element.get_array();
+        long long size = static_cast<long long>(array.size());
+        for (long long index : segment.indexes)
+        {
+          dom::element child;
+          index = index < 0 ? size + index : index;
+          if (index >= 0 && !array.at(static_cast<size_t>(index)).get(child))
+          {
+            evaluate(child, next);
+          }
+        }
+      }
+      break;
+
+    case jsonpath_selector::slice:
+      if (element.is_array())
+      {
+        dom::array array = element.get_array();
+        long long size = static_cast<long long>(array.size());
+        long long start = segment.has_start ? segment.start : 0;
+        long long end = segment.has_end ? segment.end : size;
+        start = start < 0 ? std::max(size + start, 0LL) : start;
+        end = end < 0 ? size + end : std::min(end, size);
+        long long position = 0;
+        for (dom::element child : array)
+        {
+          if (position >= end)
+          {
+            break;
+          }
+          if (position >= start && (position - start) % segment.step == 0)
+          {
+            evaluate(child, next);
+          }
+          position++;
+        }
+      }
+      break;
+    }
+  }
+};
+
+// JSONPath needs to revisit values, for filters and recursive descent, which
+// the forward-only on-demand document cannot do, so queries run over a DOM
+// tape built from the document's input. The tape belongs to the document,
+// which reuses it for later queries and frees it when it is closed or
+// collected; only the thread's dom_parser buffers outlive it.
+static int ParsedObject_query(lua_State *L)
+{
+  ParsedObject *object = check_parsed_object(L, 1);
+  size_t path_length = 0;
+  const char *path = luaL_checklstring(L, 2, &path_length);
+  check_document(L, object);
+
+  std::vector<jsonpath_segment> &segments = jsonpath_query;
+  jsonpath_compiler(L, std::string_view(path, path_length)).compile(segments);
+
+  lua_newtable(L);
+  int results = lua_gettop(L);
+
+  try
+  {
+    dom::document *tape = object->get_query_tape();
+    if (tape == nullptr)
+    {
+      std::unique_ptr<dom::document> built(new dom::document());
+      simdjson::padded_string_view input = object->get_input();
+      // The input is already padded, so the parser must not copy it.
+      error_code error = dom_parser
+                             .parse_into_document(*built, input.data(),
+                                                  input.length(), false)
+                             .error();
+      if (error)
+      {
+        throw simdjson_error(error);
+      }
+      tape = built.get();
+      object->set_query_tape(std::move(built));
+    }
+    key_cache keys(L);
+    jsonpath_evaluator(L, segments, results, keys).evaluate(tape->root(), 0);
+    lua_pop(L, 1);
+  }
+  catch (simdjson::simdjson_error &error)
+  {
+    luaL_error(L, error.what());
+  }
+
+  return 1;
+}
+
+// Lazy view of an array or object inside a ParsedObject. A child is looked
+// up with a JSON pointer only when it is indexed and is then memoized, so the
+// parts of the document that are never touched do not become Lua values.
+// The proxy's user value is a table holding the owning ParsedObject userdata,
+// which keeps it alive, and the table of memoized children. Nothing is
+// anchored in the registry, so a proxy and everything it memoized are
+// collected together.
+#define LUA_MYPROXY "ParsedObjectProxy"
+#define PROXY_OWNER 1
+#define PROXY_CHILDREN 2
+// Consecutive array indexes read in order before the rest of the array is
+// memoized in one pass.
+#define PROXY_SEQUENTIAL_READS 8
+struct ParsedObjectProxy
+{
+  ParsedObject *object;
+  bool is_array;
+  // Set once every child has been memoized, after which misses are final.
+  bool complete;
+  // Element count for arrays, or -1 until it has been counted.
+  lua_Integer length;
+  std::string pointer;
+  // The array index read last and how many indexes before it were read in
+  // order.
+  lua_Integer last_index = -1;
+  int sequential_reads = 0;
+};
+
+static ParsedObjectProxy *check_proxy(lua_State *L, int index)
+{
+  return *reinterpret_cast<ParsedObjectProxy **>(
+      luaL_checkudata(L, index, LUA_MYPROXY));
+}
+
+// Replaces the ParsedObject userdata on top of the stack with a proxy for the
+// container at pointer.
+static void push_proxy(lua_State *L, ParsedObject *object, bool is_array,
+                       std::string pointer)
+{
+  ParsedObjectProxy **proxy =
+      (ParsedObjectProxy **)(lua_newuserdata(L, sizeof(ParsedObjectProxy *)));
+  *proxy = new ParsedObjectProxy{object, is_array, false, -1,
+                                 std::move(pointer)};
+  luaL_getmetatable(L, LUA_MYPROXY);
+  lua_setmetatable(L, -2);
+
+  lua_createtable(L, 2, 0);
+  lua_pushvalue(L, -3);
+  lua_rawseti(L, -2, PROXY_OWNER);
+  lua_newtable(L);
+  lua_rawseti(L, -2, PROXY_CHILDREN);
+  lua_setuservalue(L, -2);
+  lua_remove(L, -2);
+}
+
+// Pushes the user value of the proxy at proxy_index and its table of
+// memoized children, and returns the stack index of the user value.
+static int push_proxy_slots(lua_State *L, int proxy_index)
+{
+  lua_getuservalue(L, proxy_index);
+  lua_rawgeti(L, -1, PROXY_CHILDREN);
+  return lua_gettop(L) - 1;
+}
+
+// Pushes a scalar child directly and wraps arrays and objects in a proxy
+// owned by the same ParsedObject as the parent, whose user value is at
+// slots_index.
+static void push_proxy_child(lua_State *L, ParsedObjectProxy *parent,
+                             int slots_index, ondemand::value &value,
+                             std::string pointer)
+{
+  ondemand::json_type type = value.type();
+  if (type == ondemand::json_type::array ||
+      type == ondemand::json_type::object)
+  {
+    lua_rawgeti(L, slots_index, PROXY_OWNER);
+    push_proxy(L, parent->object, type == ondemand::json_type::array,
+               std::move(pointer));
+  }
+  else
+  {
+    push_ondemand_scalar(L, value, type);
+  }
+}
+
+static void append_pointer_index(std::string &pointer, lua_Integer index)
+{
+  pointer += '/';
+  pointer += std::to_string(index);
+}
+
+// Appends key as a JSON pointer reference token, escaping '~' and '/'.
+static void append_pointer_key(std::string &pointer, std::string_view key)
+{
+  pointer += '/';
+  for (char c : key)
+  {
+    if (c == '~')
+    {
+      pointer += "~0";
+    }
+    else if (c == '/')
+    {
+      pointer += "~1";
+    }
+    else
+    {
+      pointer += c;
+    }
+  }
+}
+
+// Converts a Lua array index into a zero-based JSON index, or returns false
+// if the key cannot name an array element.
+static bool to_json_index(lua_State *L, int index, lua_Integer &json_index)
+{
+  if (lua_type(L, index) != LUA_TNUMBER)
+  {
+    return false;
+  }
+  lua_Number number = lua_tonumber(L, index);
+  if (!(number >= 1) || std::floor(number) != number ||
+      number > static_cast<lua_Number>(INT_MAX))
+  {
+    return false;
+  }
+  json_index = static_cast<lua_Integer>(number) - 1;
+  return true;
+}
+
+// Memoizes every child of the proxy at proxy_index in a single pass over its
+// container, for pairs() and sequential array access. Children that were
+// memoized before keep their identity.
+static void memoize_proxy_children(lua_State *L, int proxy_index)
+{
+  ParsedObjectProxy *proxy = check_proxy(L, proxy_index);
+  if (proxy->complete)
+  {
+    return;
+  }
+  int slots_index = push_proxy_slots(L, proxy_index);
+  int children_index = slots_index + 1;
+
+  try
+  {
+    ondemand::value container = check_document(L, proxy->object)->at_pointer(proxy->pointer);
+    if (proxy->is_array)
+    {
+      lua_Integer json_index = 0;
+      for (ondemand::value child : container.get_array())
+      {
+        lua_rawgeti(L, children_index, static_cast<int>(json_index + 1));
+        if (lua_isnil(L, -1))
+        {
+          std::string pointer = proxy->pointer;
+          append_pointer_index(pointer, json_index);
+          push_proxy_child(L, proxy, slots_index, child, std::move(pointer));
+          lua_rawseti(L, children_index, static_cast<int>(json_index + 1));
+        }
+        lua_pop(L, 1);
+        json_index++;
+      }
+      proxy->length = json_index;
+    }
+    else
+    {
+      for (ondemand::field field : container.get_object())
+      {
+        std::string_view key = field.unescaped_key();
+        lua_pushlstring(L, key.data(), key.size());
+        lua_pushvalue(L, -1);
+        lua_rawget(L, children_index);
+        if (lua_isnil(L, -1))
+        {
+          lua_pop(L, 1);
+          std::string pointer = proxy->pointer;
+          append_pointer_key(pointer, key);
+          push_proxy_child(L, proxy, slots_index, field.value(),
+                           std::move(pointer));
+          lua_rawset(L, children_index);
+        }
+        else
+        {
+          lua_pop(L, 2);
+        }
+      }
+    }
+  }
+  catch (simdjson::simdjson_error &error)
+  {
+    luaL_error(L, error.what());
+  }
+
+  proxy->complete = true;
+  lua_settop(L, slots_index - 1);
+}
+
+// Pushes the child of the proxy at proxy_index named by the key at key_index,
+// or nil if there is no such child. A child that has not been memoized yet is
+// looked up from the start of the document, because the on-demand iterator
+// cannot resume at the parent, so reaching a value d levels down through
+// fresh proxies costs O(d^2) pointer steps.
+static void push_proxy_field(lua_State *L, int proxy_index, int key_index)
+{
+  ParsedObjectProxy *proxy = check_proxy(L, proxy_index);
+  lua_Integer json_index = 0;
+  bool is_index = proxy->is_array && to_json_index(L, key_index, json_index);
+  if (is_index)
+  {
+    proxy->sequential_reads =
+        json_index == proxy->last_index + 1 ? proxy->sequential_reads + 1 : 1;
+    proxy->last_index = json_index;
+  }
+
+  int slots_index = push_proxy_slots(L, proxy_index);
+  int children_index = slots_index + 1;
+  lua_pushvalue(L, key_index);
+  lua_rawget(L, children_index);
+  if (!lua_isnil(L, -1) || proxy->complete)
+  {
+    lua_replace(L, slots_index);
+    lua_settop(L, slots_index);
+    return;
+  }
+  lua_pop(L, 1);
+
+  if (is_index && proxy->sequential_reads >= PROXY_SEQUENTIAL_READS)
+  {
+    // A numeric loop is walking the array in order. Memoize the rest of it
+    // in one pass rather than scanning from the start of the document for
+    // every element. A few reads of nearby elements stay lookups of one
+    // element each.
+    memoize_proxy_children(L, proxy_index);
+    lua_rawgeti(L, children_index, static_cast<int>(json_index + 1));
+    lua_replace(L, slots_index);
+    lua_settop(L, slots_index);
+    return;
+  }
+
+  bool found = false;
+  try
+  {
+    std::string pointer = proxy->pointer;
+    if (is_index)
+    {
+      append_pointer_index(pointer, json_index);
+      found = true;
+    }
+    else if (!proxy->is_array && lua_type(L, key_index) == LUA_TSTRING)
+    {
+      size_t length;
+      const char *key = lua_tolstring(L, key_index, &length);
+      append_pointer_key(pointer, std::string_view(key, length));
+      found = true;
+    }
+
+    ondemand::value value;
+    if (found)
+    {
+      simdjson::error_code error =
+          check_document(L, proxy->object)->at_pointer(pointer).get(value);
+      if (error == NO_SUCH_FIELD || error == INDEX_OUT_OF_BOUNDS)
+      {
+        found = false;
+      }
+      else if (error)
+      {
+        throw simdjson_error(error);
+      }
+    }
+
+    if (found)
+    {
+      push_proxy_child(L, proxy, slots_index, value, std::move(pointer));
+    }
+    else
+    {
+      lua_pushnil(L);
+    }
+  }
+  catch (simdjson::simdjson_error &error)
+  {
+    luaL_error(L, error.what());
+  }
+
+  if (found)
+  {
+    lua_pushvalue(L, key_index);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, children_index);
+  }
+  lua_replace(L, slots_index);
+  lua_settop(L, slots_index);
+}
+
+static int ParsedObject_root(lua_State *L)
+{
+  ParsedObject *object =
+      *reinterpret_cast<ParsedObject **>(luaL_checkudata(L, 1, LUA_MYOBJECT));
+
+  try
+  {
+    ondemand::document *document = check_document(L, object);
+    document->rewind();
+    ondemand::json_type type = document->type();
+    if (type == ondemand::json_type::array ||
+        type == ondemand::json_type::object)
+    {
+      lua_pushvalue(L, 1);
+      push_proxy(L, object, type == ondemand::json_type::array,
+                 std::string());
+    }
+    else
+    {
+      push_ondemand_scalar(L, *document, type);
+    }
+  }
+  catch (simdjson::simdjson_error &error)
+  {
+    luaL_error(L, error.what());
+  }
+
+  return 1;
+}
+
+static int ParsedObjectProxy_index(lua_State *L)
+{
+  push_proxy_field(L, 1, 2);
+  return 1;
+}
+
+static int ParsedObjectProxy_len(lua_State *L)
+{
+  ParsedObjectProxy *proxy = check_proxy(L, 1);
+  // Like a table built by parse(), an object has no sequence part.
+  if (!proxy->is_array)
+  {
+    lua_pushinteger(L, 0);
+    return 1;
+  }
+
+  if (proxy->length < 0)
+  {
+    try
+    {
+      ondemand::array array =
+          check_document(L, proxy->object)->at_pointer(proxy->pointer).get_array();
+      proxy->length = static_cast<lua_Integer>(array.count_elements());
+    }
+    catch (simdjson::simdjson_error &error)
+    {
+      luaL_error(L, error.what());
+    }
+  }
+  lua_pushinteger(L, proxy->length);
+  return 1;
+}
+
+static int ParsedObjectProxy_next(lua_State *L)
+{
+  check_proxy(L, 1);
+  lua_settop(L, 2);
+  lua_getuservalue(L, 1);
+  lua_rawgeti(L, -1, PROXY_CHILDREN);
+  lua_replace(L, -2);
+  lua_insert(L, 2);
+  if (lua_next(L, 2) != 0)
+  {
+    return 2;
+  }
+  lua_pushnil(L);
+  return 1;
+}
+
+static int ParsedObjectProxy_pairs(lua_State *L)
+{
+  memoize_proxy_children(L, 1);
+  lua_pushcfunction(L, ParsedObjectProxy_next);
+  lua_pushvalue(L, 1);
+  lua_pushnil(L);
+  return 3;
+}
+
+static int ParsedObjectProxy_inext(lua_State *L)
+{
+  lua_Integer index = luaL_checkinteger(L, 2) + 1;
+  lua_settop(L, 1);
+  lua_pushinteger(L, index);
+  push_proxy_field(L, 1, 2);
+  return lua_isnil(L, -1) ? 1 : 2;
+}
+
+// ipairs() walks the whole array, so it is memoized in one pass up front.
+static int ParsedObjectProxy_ipairs(lua_State *L)
+{
+  if (check_proxy(L, 1)->is_array)
+  {
+    memoize_proxy_children(L, 1);
+  }
+  lua_pushcfunction(L, ParsedObjectProxy_inext);
+  lua_pushvalue(L, 1);
+  lua_pushinteger(L, 0);
+  return 3;
+}
+
+static int ParsedObjectProxy_delete(lua_State *L)
+{
+  delete *reinterpret_cast<ParsedObjectProxy **>(lua_touserdata(L, 1));
+  return 0;
+}
+
+// Iterator state behind parseMany and openManyFile. A stream owns its input
+// and its parser: parse() may run between two documents and reuses the
+// thread_local parser. When simdjson is built with thread support, stage 1
+// for the next batch runs on simdjson's worker thread while the current
+// batch is being converted.
+#define LUA_MYSTREAM "DocumentStream"
+class DocumentStream
+{
+private:
+  simdjson::padded_string json_string;
+  json_file_input json_file;
+  ondemand::parser parser;
+  ondemand::document_stream stream;
+  ondemand::document_stream::iterator position;
+  bool started = false;
+  bool finished = false;
+
+public:
+  DocumentStream(const char *json_file, size_t batch_size)
+  {
+    this->json_file.load(json_file);
+    simdjson::padded_string_view json = this->json_file.view();
+    this->stream =
+        this->parser.iterate_many(json.data(), json.length(), batch_size);
+  }
+  DocumentStream(const char *json_str, size_t json_str_len, size_t batch_size)
+      : json_string(json_str, json_str_len)
+  {
+    this->stream = this->parser.iterate_many(json_string, batch_size);
+  }
+  ~DocumentStream() {}
+
+  // Moves to the next document. Returns false once the input is exhausted or
+  // after finish() has been called. Throws, once, if the input ends in the
+  // middle of a document, which iterate_many would otherwise skip.
+  bool next()
+  {
+    if (this->finished)
+    {
+      return false;
+    }
+    if (this->started)
+    {
+      ++this->position;
+    }
+    else
+    {
+      this->position = this->stream.begin();
+      this->started = true;
+    }
+    this->finished = !(this->position != this->stream.end());
+    if (this->finished && this->stream.truncated_bytes() > 0)
+    {
+      throw simdjson_error(INCOMPLETE_ARRAY_OR_OBJECT);
+    }
+    return !this->finished;
+  }
+  ondemand::document_reference current() { return *this->position; }
+  // A stream cannot resume after an error.
+  void finish() { this->finished = true; }
+};
+
+static int DocumentStream_delete(lua_State *L)
+{
+  delete *reinterpret_cast<DocumentStream **>(lua_touserdata(L, 1));
+  return 0;
+}
+
+static int DocumentStream_next(lua_State *L)
+{
+  DocumentStream *stream = *reinterpret_cast<DocumentStream **>(
+      lua_touserdata(L, lua_upvalueindex(1)));
+
+  try
+  {
+    if (!stream->next())
+    {
+      lua_pushnil(L);
+      return 1;
+    }
+    ondemand::document_reference doc = stream->current();
+    key_cache keys(L);
+    convert_ondemand_element_to_table(L, doc, parse_options(), keys);
+  }
+  catch (simdjson::simdjson_error &error)
+  {
+    stream->finish();
+    luaL_error(L, error.what());
+  }
+
+  return 1;
+}
+
+static size_t check_batch_size(lua_State *L, int index)
+{
+  lua_Integer batch_size =
+      luaL_optinteger(L, index, static_cast<lua_Integer>(dom::DEFAULT_BATCH_SIZE));
+  luaL_argcheck(L, batch_size > 0, index, "batch size must be positive");
+  return static_cast<size_t>(batch_size);
+}
+
+// Wraps the DocumentStream userdata on top of the stack in an iterator
+// function for a generic for loop.
+static void push_stream_iterator(lua_State *L)
+{
+  luaL_getmetatable(L, LUA_MYSTREAM);
+  lua_setmetatable(L, -2);
+  lua_pushcclosure(L, DocumentStream_next, 1);
+}
+
+static int parse_many(lua_State *L)
+{
+  size_t json_str_len;
+  const char *json_str = luaL_checklstring(L, 1, &json_str_len);
+  size_t batch_size = check_batch_size(L, 2);
+
+  try
+  {
+    DocumentStream **stream =
+        (DocumentStream **)(lua_newuserdata(L, sizeof(DocumentStream *)));
+    *stream = new DocumentStream(json_str, json_str_len, batch_size);
+    push_stream_iterator(L);
+  }
+  catch (simdjson::simdjson_error &error)
+  {
+    luaL_error(L, error.what());
+  }
+
+  return 1;
+}
+
+static int open_many_file(lua_State *L)
+{
+  const char *json_file = luaL_checkstring(L, 1);
+  size_t batch_size = check_batch_size(L, 2);
+
+  try
+  {
+    DocumentStream **stream =
+        (DocumentStream **)(lua_newuserdata(L, sizeof(DocumentStream *)));
+    *stream = new DocumentStream(json_file, batch_size);
+    push_stream_iterator(L);
+  }
+  catch (simdjson::simdjson_error &error)
+  {
+    luaL_error(L, error.what());
+  }
+
+  return 1;
+}
+
+// A parse submitted through parseAsync. The worker parses into the job's own
+// dom::document, so its parser is free for the next job as soon as it is done
+// and the Lua thread only has to walk the finished tape.
+struct async_parse_job
+{
+  simdjson::padded_string json;
+  dom::document document;
+  error_code error = SUCCESS;
+  // All guarded by async_parse_pool's mutex.
+  bool done = false;
+  bool cancelled = false;
+#if LUA_SIMDJSON_HAS_FORK
+  // Process whose workers the job was queued for.
+  pid_t pid = 0;
+#endif
+
+  async_parse_job(const char *json_str, size_t json_str_len)
+      : json(json_str, json_str_len) {}
+};
+
+#define DEFAULT_ASYNC_WORKER_COUNT 1
+#define MAX_ASYNC_WORKER_COUNT 256
+// The workers outlive the Lua states that submit to them, so they keep their
+// own limit rather than a state's parserPoolMaxCapacity. A worker whose
+// parser grew beyond it frees the parser after the job.
+#define ASYNC_WORKER_MAX_CAPACITY (4 * 1024 * 1024)
+
+struct async_worker
+{
+  std::thread thread;
+  // Set by the thread, under the pool's mutex, when it is about to return.
+  bool exited = false;
+};
+
+// Worker threads shared by every Lua state in the process. A thread is
+// started only when a job is queued while no worker is idle, up to the
+// worker count set with setAsyncWorkerCount, so a process that uses
+// parseAsync lightly runs a single worker. Each keeps its own dom::parser,
+// so its buffers are reused from one job to the next.
+class async_parse_pool
+{
+private:
+  std::mutex mutex;
+  std::condition_variable work_ready;
+  std::condition_variable work_done;
+  std::deque<std::shared_ptr<async_parse_job>> queue;
+  // A list, so that each thread can mark its own entry as exited.
+  std::list<async_worker> workers;
+  // Threads that have not exited, and those of them waiting for a job.
+  size_t live_workers = 0;
+  size_t idle_workers = 0;
+  size_t max_workers = DEFAULT_ASYNC_WORKER_COUNT;
+  bool stopping = false;
+#if LUA_SIMDJSON_HAS_FORK
+  // Process that started the workers, or 0 before they are started.
+  std::atomic<pid_t> owner{0};
+#endif
+
+  void run(async_worker *worker)
+  {
+    dom::parser parser;
+    std::unique_lock<std::mutex> lock(this->mutex);
+    while (true)
+    {
+      this->idle_workers++;
+      this->work_ready.wait(lock, [this]
+                            { return this->stopping || !this->queue.empty() ||
+                                     this->live_workers > this->max_workers; });
+      this->idle_workers--;
+      // Surplus threads exit once the worker count has been lowered.
+      if (this->stopping || this->live_workers > this->max_workers)
+      {
+        this->live_workers--;
+        worker->exited = true;
+        return;
+      }
+      std::shared_ptr<async_parse_job> job = this->queue.front();
+      this->queue.pop_front();
+      if (job->cancelled)
+      {
+        continue;
+      }
+
+      lock.unlock();
+      // The input is already padded, so the parser must not copy it.
+      error_code error = parser
+                             .parse_into_document(job->document, job->json.data(),
+                                                  job->json.size(), false)
+                             .error();
+      if (parser.capacity() > ASYNC_WORKER_MAX_CAPACITY)
+      {
+        parser = dom::parser();
+      }
+      lock.lock();
+
+      job->error = error;
+      job->done = true;
+      this->work_done.notify_all();
+    }
+  }
+
+  // Called with the lock held. Joins the threads that have exited, which no
+  // longer need the lock.
+  void remove_exited_workers()
+  {
+    for (auto worker = this->workers.begin(); worker != this->workers.end();)
+    {
+      if (worker->exited)
+      {
+        worker->thread.join();
+        worker = this->workers.erase(worker);
+      }
+      else
+      {
+        ++worker;
+      }
+    }
+  }
+
+  // Called with the lock held.
+  void enqueue(std::shared_ptr<async_parse_job> job)
+  {
+    remove_exited_workers();
+    if (this->queue.size() >= this->idle_workers &&
+        this->live_workers < this->max_workers)
+    {
+#if LUA_SIMDJSON_HAS_FORK
+      this->owner = getpid();
+#endif
+      this->workers.emplace_back();
+      async_worker *worker = &this->workers.back();
+      try
+      {
+        // The thread cannot run before the lock is released.
+        worker->thread = std::thread(&async_parse_pool::run, this, worker);
+        this->live_workers++;
+      }
+      catch (...)
+      {
+        this->workers.pop_back();
+        // Jobs still go to the workers that are running, if any.
+        if (this->live_workers == 0)
+        {
+          throw;
+        }
+      }
+    }
+#if LUA_SIMDJSON_HAS_FORK
+    job->pid = this->owner;
+#endif
+    this->queue.push_back(std::move(job));
+    this->work_ready.notify_one();
+  }
+
+#if LUA_SIMDJSON_HAS_FORK
+  bool is_forked()
+  {
+    pid_t owner = this->owner;
+    return owner != 0 && owner != getpid();
+  }
+
+  // A child created by fork() has this object's memory but none of its
+  // threads, which may have held the mutex or been halfway through changing
+  // the queue. Everything they shared is abandoned and rebuilt; leaking it
+  // is the only safe way to get rid of it. Jobs the child inherited are
+  // queued again by resubmit_inherited() when they are waited on.
+  void recover_from_fork()
+  {
+    new (&this->mutex) std::mutex();
+    new (&this->work_ready) std::condition_variable();
+    new (&this->work_done) std::condition_variable();
+    new (&this->queue) std::deque<std::shared_ptr<async_parse_job>>();
+    // A std::thread for a thread that does not exist here can be neither
+    // joined nor destroyed.
+    new (&this->workers) std::list<async_worker>();
+    this->live_workers = 0;
+    this->idle_workers = 0;
+    this->owner = 0;
+  }
+#endif
+
+  std::unique_lock<std::mutex> lock()
+  {
+#if LUA_SIMDJSON_HAS_FORK
+    if (this->is_forked())
+    {
+      this->recover_from_fork();
+    }
+#endif
+    return std::unique_lock<std::mutex>(this->mutex);
+  }
+
+  // Called with the lock held.
+  void resubmit_inherited(const std::shared_ptr<async_parse_job> &job)
+  {
+#if LUA_SIMDJSON_HAS_FORK
+    if (!job->done && job->pid != getpid())
+    {
+      this->enqueue(job);
+    }
+#else
+    (void)job;
+#endif
+  }
+
+public:
+  // Queued jobs are dropped rather than parsed, so exit and dlclose only
+  // wait for the jobs already running.
+  ~async_parse_pool()
+  {
+#if LUA_SIMDJSON_HAS_FORK
+    if (this->is_forked())
+    {
+      new (&this->workers) std::list<async_worker>();
+      return;
+    }
+#endif
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->stopping = true;
+      this->queue.clear();
+    }
+    this->work_ready.notify_all();
+    for (async_worker &worker : this->workers)
+    {
+      worker.thread.join();
+    }
+  }
+
+  void set_worker_count(size_t count)
+  {
+    {
+      std::unique_lock<std::mutex> lock = this->lock();
+      this->max_workers = count;
+    }
+    this->work_ready.notify_all();
+  }
+
+  size_t get_worker_count()
+  {
+    std::unique_lock<std::mutex> lock = this->lock();
+    return this->max_workers;
+  }
+
+  void submit(std::shared_ptr<async_parse_job> job)
+  {
+    std::unique_lock<std::mutex> lock = this->lock();
+    this->enqueue(std::move(job));
+  }
+
+  bool is_done(const std::shared_ptr<async_parse_job> &job)
+  {
+    std::unique_lock<std::mutex> lock = this->lock();
+    this->resubmit_inherited(job);
+    return job->done;
+  }
+
+  void wait(const std::shared_ptr<async_parse_job> &job)
+  {
+    std::unique_lock<std::mutex> lock = this->lock();
+    this->resubmit_inherited(job);
+    this->work_done.wait(lock, [&job]
+                         { return job->done; });
+  }
+
+  // A job nobody can collect any more is skipped if it has not started yet.
+  void cancel(async_parse_job &job)
+  {
+    std::unique_lock<std::mutex> lock = this->lock();
+    job.cancelled = true;
+  }
+};
+
+static async_parse_pool async_pool;
+
+// Handle returned by parseAsync. Once the result has been converted, the job
+// and its document are released and the table is kept in the registry so
+// later calls return the same value.
+#define LUA_MYHANDLE "ParseHandle"
+struct ParseHandle
+{
+  std::shared_ptr<async_parse_job> job;
+  int result_ref = LUA_NOREF;
+};
+
+static ParseHandle *check_parse_handle(lua_State *L)
+{
+  return reinterpret_cast<ParseHandle *>(luaL_checkudata(L, 1, LUA_MYHANDLE));
+}
+
+// Pushes the result of a finished job.
+static void push_parse_handle_result(lua_State *L, ParseHandle *handle)
+{
+  if (handle->result_ref == LUA_NOREF)
+  {
+    if (handle->job->error)
+    {
+      luaL_error(L, error_message(handle->job->error));
+    }
+    try
+    {
+      key_cache keys(L);
+      convert_dom_element_to_table(L, handle->job->document.root(), keys);
+    }
+    catch (simdjson::simdjson_error &error)
+    {
+      luaL_error(L, error.what());
+    }
+    lua_pushvalue(L, -1);
+    handle->result_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    handle->job.reset();
+    return;
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, handle->result_ref);
+}
+
+static int ParseHandle_wait(lua_State *L)
+{
+  ParseHandle *handle = check_parse_handle(L);
+  if (handle->job)
+  {
+    async_pool.wait(handle->job);
+  }
+  push_parse_handle_result(L, handle);
+  return 1;
+}
+
+static int ParseHandle_poll(lua_State *L)
+{
+  ParseHandle *handle = check_parse_handle(L);
+  if (handle->job && !async_pool.is_done(handle->job))
+  {
+    lua_pushnil(L);
+    return 1;
+  }
+  push_parse_handle_result(L, handle);
+  return 1;
+}
+
+static int ParseHandle_delete(lua_State *L)
+{
+  ParseHandle *handle = reinterpret_cast<ParseHandle *>(lua_touserdata(L, 1));
+  if (handle->job)
+  {
+    async_pool.cancel(*handle->job);
+  }
+  luaL_unref(L, LUA_REGISTRYINDEX, handle->result_ref);
+  handle->~ParseHandle();
+  return 0;
+}
+
+static int parse_async(lua_State *L)
+{
+  size_t json_str_len;
+  const char *json_str = luaL_checklstring(L, 1, &json_str_len);
+
+  // The worker cannot touch the Lua string, which may be collected while the
+  // job is queued, so the input is copied into the job first.
+  ParseHandle *handle =
+      reinterpret_cast<ParseHandle *>(lua_newuserdata(L, sizeof(ParseHandle)));
+  new (handle) ParseHandle();
+  luaL_getmetatable(L, LUA_MYHANDLE);
+  lua_setmetatable(L, -2);
+
+  try
+  {
+    handle->job = std::make_shared<async_parse_job>(json_str, json_str_len);
+    if (handle->job->json.data() == nullptr)
+    {
+      throw simdjson_error(MEMALLOC);
+    }
+    async_pool.submit(handle->job);
+  }
+  catch (std::exception &error)
+  {
+    // Thread creation and allocation failures must not unwind into Lua.
+    handle->job.reset();
+    luaL_error(L, error.what());
+  }
+
+  return 1;
+}
+
+static int set_parser_pool_size(lua_State *L)
+{
+  size_t pool_size = static_cast<size_t>(check_integer_setting(
+      L, 1, "parser pool size", 0, MAX_PARSER_POOL_SIZE));
+  write_size_setting(L, LUA_SIMDJSON_PARSER_POOL_SIZE_KEY, pool_size);
+  std::vector<std::unique_ptr<ondemand::parser>> &pool = parser_pool;
+  if (pool.size() > pool_size)
+  {
+    pool.resize(pool_size);
+  }
+  return 0;
+}
+
+static int get_parser_pool_size(lua_State *L)
+{
+  lua_pushinteger(L, static_cast<lua_Integer>(read_parser_pool_size(L)));
+  return 1;
+}
+
+static int set_parser_pool_max_capacity(lua_State *L)
+{
+  size_t max_capacity = static_cast<size_t>(check_integer_setting(
+      L, 1, "parser pool capacity", 0, SIMDJSON_MAXSIZE_BYTES));
+  write_size_setting(L, LUA_SIMDJSON_PARSER_POOL_MAX_CAPACITY_KEY,
+                     max_capacity);
+  std::vector<std::unique_ptr<ondemand::parser>> &pool = parser_pool;
+  for (size_t i = pool.size(); i > 0; i--)
+  {
+    if (pool[i - 1]->capacity() > max_capacity)
+    {
+      pool.erase(pool.begin() + static_cast<std::ptrdiff_t>(i - 1));
+    }
+  }
+  return 0;
+}
+
+static int get_parser_pool_max_capacity(lua_State *L)
+{
+  lua_pushinteger(
+      L, static_cast<lua_Integer>(read_parser_pool_max_capacity(L)));
+  return 1;
+}
+
+// The worker count is shared by the whole process, not stored per state.
+static int set_async_worker_count(lua_State *L)
+{
+  size_t count = static_cast<size_t>(check_integer_setting(
+      L, 1, "async worker count", 1, MAX_ASYNC_WORKER_COUNT));
+  async_pool.set_worker_count(count);
+  return 0;
+}
+
+static int get_async_worker_count(lua_State *L)
+{
+  lua_pushinteger(L, static_cast<lua_Integer>(async_pool.get_worker_count()));
+  return 1;
+}
+
+static int ParsedObject_newindex(lua_State *L)
+{
+  luaL_error(L, "This should be treated as a read-only table. We may one day add array access for the elements, and it'll likely not be modifiable.");
+  return 1;
 }
 
 static const struct luaL_Reg arraylib_m[] = {
     {"at", ParsedObject_atPointer},
     {"atPointer", ParsedObject_atPointer},
+    {"atPointers", ParsedObject_atPointers},
+    {"query", ParsedObject_query},
+    {"root", ParsedObject_root},
+    {"close", ParsedObject_close},
     {"__newindex", ParsedObject_newindex},
     {"__gc", ParsedObject_delete},
     {NULL, NULL}};
 
+static const struct luaL_Reg pointer_m[] = {
+    {"__tostring", CompiledPointer_tostring},
+    {"__gc", CompiledPointer_delete},
+    {NULL, NULL}};
+
+static const struct luaL_Reg handle_m[] = {
+    {"wait", ParseHandle_wait},
+    {"poll", ParseHandle_poll},
+    {"__gc", ParseHandle_delete},
+    {NULL, NULL}};
+
+static const struct luaL_Reg proxy_m[] = {
+    {"__index", ParsedObjectProxy_index},
+    {"__len", ParsedObjectProxy_len},
+    {"__pairs", ParsedObjectProxy_pairs},
+    {"__ipairs", ParsedObjectProxy_ipairs},
+    {"__newindex", ParsedObject_newindex},
+    {"__gc", ParsedObjectProxy_delete},
+    {NULL, NULL}};
+
 int luaopen_simdjson(lua_State *L)
 {
+  luaL_newmetatable(L, LUA_MYSTREAM);
+  lua_pushcfunction(L, DocumentStream_delete);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, LUA_MYPOINTER);
+  luaL_setfuncs(L, pointer_m, 0);
+  lua_pushlightuserdata(L, const_cast<char *>(&compiled_pointer_metatable_key));
+  lua_insert(L, -2);
+  lua_rawset(L, LUA_REGISTRYINDEX);
+
+  luaL_newmetatable(L, LUA_MYHANDLE);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_setfuncs(L, handle_m, 0);
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, LUA_MYPROXY);
+  luaL_setfuncs(L, proxy_m, 0);
+  lua_pop(L, 1);
+
+  register_encoder_types(L);
+
   luaL_newmetatable(L, LUA_MYOBJECT);
   lua_pushvalue(L, -1); /* duplicates the metatable */
   lua_setfield(L, -2, "__index");
@@ -11,20 +11,51 @@
 extern "C" {
 	static int parse(lua_State*);
 	static int parse_file(lua_State*);
+	static int parse_async(lua_State*);
+	static int compile_pointer(lua_State*);
+	static int validate(lua_State*);
+	static int minify(lua_State*);
+	static int extract(lua_State*);
+	static int parse_many(lua_State*);
+	static int open_many_file(lua_State*);
 	static int active_implementation(lua_State*);
 	static int ParsedObject_open(lua_State*);
 	static int ParsedObject_open_file(lua_State*);
+	static int set_parser_pool_size(lua_State*);
+	static int get_parser_pool_size(lua_State*);
+	static int set_parser_pool_max_capacity(lua_State*);
+	static int get_parser_pool_max_capacity(lua_State*);
+	static int set_async_worker_count(lua_State*);
+	static int get_async_worker_count(lua_State*);
 	static const struct luaL_Reg luasimdjson[] = {
 		{"parse", parse},
 		{"parseFile", parse_file},
+		{"parseAsync", parse_async},
+		{"compilePointer", compile_pointer},
+		{"extract", extract},
+		{"validate", validate},
+		{"minify", minify},
+		{"parseMany", parse_many},
+		{"openManyFile", open_many_file},
 		{"activeImplementation", active_implementation},
 		{"open", ParsedObject_open},
 		{"openFile", ParsedObject_open_file},
+		{"setParserPoolSize", set_parser_pool_size},
+		{"getParserPoolSize", get_parser_pool_size},
+		{"setParserPoolMaxCapacity", set_parser_pool_max_capacity},
+		{"getParserPoolMaxCapacity", get_parser_pool_max_capacity},
+		{"setAsyncWorkerCount", set_async_worker_count},
+		{"getAsyncWorkerCount", get_async_worker_count},
 		{"encode", encode},
+		{"encodeTo", encode_to},
+		{"encodeBuffer", encode_buffer_value},
+		{"encodeLines", encode_lines},
+		{"encoder", new_encoder},
 		{"setMaxEncodeDepth", set_max_encode_depth},
 		{"getMaxEncodeDepth", get_max_encode_depth},
 		{"setEncodeBufferSize", set_encode_buffer_size},
 		{"getEncodeBufferSize", get_encode_buffer_size},
+		{"getEncodeBufferCapacity", get_encode_buffer_capacity},
 
 		{NULL, NULL},
 	};